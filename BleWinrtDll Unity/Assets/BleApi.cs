@@ -89,6 +89,26 @@ public class BleApi
     [DllImport("BleWinrtDll.dll", EntryPoint = "Quit")]
     public static extern void Quit();
 
+    [DllImport("BleWinrtDll.dll", EntryPoint = "QuitWithTimeout")]
+    public static extern bool QuitWithTimeout(uint timeoutMs);
+
+    // keeps connections and subscriptions in the dll across a domain reload, call Reattach in the next domain
+    [DllImport("BleWinrtDll.dll", EntryPoint = "Detach")]
+    public static extern void Detach();
+
+    [DllImport("BleWinrtDll.dll", EntryPoint = "Reattach")]
+    public static extern void Reattach();
+
+#if UNITY_EDITOR
+    // the editor keeps the dll loaded across script reloads, so the old domain detaches and the new one reattaches
+    [UnityEditor.InitializeOnLoadMethod]
+    static void HookDomainReload()
+    {
+        UnityEditor.AssemblyReloadEvents.beforeAssemblyReload += Detach;
+        UnityEditor.AssemblyReloadEvents.afterAssemblyReload += Reattach;
+    }
+#endif
+
     [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
     public struct ErrorMessage
     {
@@ -0,0 +1,527 @@
+#pragma once
+
+// Platform independent parts of the notification and lookup paths. The dll instantiates them with winrt types,
+// the benchmarks in /bench with plain pointers.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "BleTypes.h"
+
+// using hashes of uuids to omit storing the c-strings in reliable storage
+inline long hsh(const wchar_t* wstr)
+{
+	long hash = 5381;
+	int c;
+	while (c = *wstr++)
+		hash = ((hash << 5) + hash) + c;
+	return hash;
+}
+
+const uint8_t GUID_BYTE_ORDER[] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+// parses a uuid string like "{f6f04ffa-9a61-11e9-a2a3-2a2ae2dbcce4}" into the memory layout of a guid
+inline void parse_uuid(const wchar_t* value, uint8_t (&buf)[16])
+{
+	memset(buf, 0, sizeof(buf));
+	int offset = 0;
+	for (int i = 0; i < (int)wcslen(value); i++) {
+		if (value[i] >= '0' && value[i] <= '9')
+		{
+			uint8_t digit = value[i] - '0';
+			buf[GUID_BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
+			offset++;
+		}
+		else if (value[i] >= 'A' && value[i] <= 'F')
+		{
+			uint8_t digit = 10 + value[i] - 'A';
+			buf[GUID_BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
+			offset++;
+		}
+		else if (value[i] >= 'a' && value[i] <= 'f')
+		{
+			uint8_t digit = 10 + value[i] - 'a';
+			buf[GUID_BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
+			offset++;
+		}
+		else
+		{
+			// skip char
+		}
+	}
+}
+
+// like wcscpy_s but truncates instead of invoking the invalid parameter handler
+template <size_t N>
+void copy_wstr(wchar_t (&dst)[N], const wchar_t* src)
+{
+	size_t i = 0;
+	for (; i < N - 1 && src[i]; i++)
+		dst[i] = src[i];
+	dst[i] = 0;
+}
+
+// builds the record that is handed out by PollData
+inline void fill_data(BLEData& data, const wchar_t* deviceId, const wchar_t* serviceUuid, const wchar_t* characteristicUuid, const uint8_t* buf, size_t size)
+{
+	copy_wstr(data.characteristicUuid, characteristicUuid);
+	copy_wstr(data.serviceUuid, serviceUuid);
+	copy_wstr(data.deviceId, deviceId);
+	data.size = (uint16_t)(size < sizeof(data.buf) ? size : sizeof(data.buf));
+	memcpy(data.buf, buf, data.size);
+}
+
+template <class T>
+struct SignalQueue {
+	std::queue<T> items{};
+	std::mutex lock;
+	std::condition_variable signal;
+
+	void push(const T& item) {
+		std::lock_guard guard(lock);
+		items.push(item);
+		signal.notify_one();
+	}
+
+	// Returns false if no item is available. In blocking mode waits until an item is available or quit is set.
+	bool pop(T* item, bool block, const std::atomic<bool>& quit) {
+		std::unique_lock<std::mutex> guard(lock);
+		if (block) {
+			signal.wait(guard, [&] { return !items.empty() || quit; });
+			if (quit)
+				return false;
+		}
+		if (!items.empty()) {
+			*item = items.front();
+			items.pop();
+			return true;
+		}
+		return false;
+	}
+
+	// Like pop, but takes up to max items under one lock. Returns the number of items taken.
+	size_t popBatch(T* out, size_t max, bool block, const std::atomic<bool>& quit) {
+		std::unique_lock<std::mutex> guard(lock);
+		if (block) {
+			signal.wait(guard, [&] { return !items.empty() || quit; });
+			if (quit)
+				return 0;
+		}
+		size_t n = 0;
+		while (n < max && !items.empty()) {
+			out[n++] = items.front();
+			items.pop();
+		}
+		return n;
+	}
+
+	void clear() {
+		std::lock_guard guard(lock);
+		items = {};
+	}
+
+	size_t size() {
+		std::lock_guard guard(lock);
+		return items.size();
+	}
+
+	// Releases all blocked pollers, call after quit was set. Notifying under the lock makes sure that a poller that
+	// has just checked quit is already waiting.
+	void wake() {
+		std::lock_guard guard(lock);
+		signal.notify_all();
+	}
+};
+
+// Calls the handler for every posted item on an own thread, so that posting only costs a queue push.
+template <class T>
+class DispatchThread {
+public:
+	// init runs first on the new thread, e.g. to set its priority
+	template <class Init, class Handler>
+	void start(Init init, Handler handler) {
+		{
+			std::lock_guard guard(queue.lock);
+			queue.items = {};
+			stopFlag = false;
+		}
+		worker = std::thread([this, init, handler]() {
+			init();
+			T item;
+			while (!stopFlag)
+				if (queue.pop(&item, true, stopFlag))
+					handler(item);
+		});
+	}
+
+	// Returns false if the thread is stopped, the item is not queued then. Checked under the queue lock, so that a
+	// post racing with stop can't leave an item behind for the next start.
+	bool post(const T& item) {
+		std::lock_guard guard(queue.lock);
+		if (stopFlag)
+			return false;
+		queue.items.push(item);
+		queue.signal.notify_one();
+		return true;
+	}
+
+	// items that were not handled yet are dropped
+	void stop() {
+		{
+			std::lock_guard guard(queue.lock);
+			stopFlag = true;
+			queue.signal.notify_all();
+		}
+		if (worker.joinable())
+			worker.join();
+		queue.clear();
+	}
+
+	bool running() const {
+		return worker.joinable();
+	}
+
+	// A host that exits without stop, e.g. after a Detach, must not run into terminate because of a joinable thread.
+	// Joining or locking is no option at that point: the thread may be gone already, possibly holding the queue lock,
+	// or block on the loader lock. So it is only told to stop.
+	~DispatchThread() {
+		stopFlag = true;
+		queue.signal.notify_all();
+		if (worker.joinable())
+			worker.detach();
+	}
+
+private:
+	SignalQueue<T> queue;
+	std::atomic<bool> stopFlag = true;
+	std::thread worker;
+};
+
+// Tracks the sequence numbers and arrival times of one notification stream at constant cost per notification.
+// The sequence number is an unsigned little endian field of 1 to 4 bytes that counts modulo wrap (0: the full field).
+// A jump by less than half the range counts as gap, a step back by at most REORDER_WINDOW as reordered frame that was
+// counted as lost before. Any other step back, e.g. the device restarted its counter, is a discontinuity and the
+// analyzer continues from the new sequence number.
+class StreamAnalyzer {
+public:
+	static const uint64_t REORDER_WINDOW = 32;
+
+	// Fails for a field wider than 4 bytes and for a wrap of 1 or beyond the range of the field: every frame would be
+	// a duplicate or every rollover a discontinuity. The previous configuration is kept then.
+	bool configure(uint32_t offset, uint32_t width, uint32_t wrap, uint32_t expectedIntervalUs) {
+		if (width > 4)
+			return false;
+		const uint64_t range = (uint64_t)1 << (8 * width);
+		if (width > 0 && (wrap == 1 || wrap > range))
+			return false;
+		std::lock_guard guard(lock);
+		this->offset = offset;
+		this->width = width;
+		this->wrap = wrap != 0 ? wrap : range;
+		this->expectedIntervalUs = expectedIntervalUs;
+		current = { };
+		hasLast = false;
+		totalIntervalUs = 0;
+		configured = true;
+		return true;
+	}
+
+	void update(const uint8_t* buf, size_t size, int64_t timeUs) {
+		if (!configured)
+			return;
+		std::lock_guard guard(lock);
+		current.received++;
+		if (hasLast)
+			addInterval(timeUs - lastTimeUs);
+		lastTimeUs = timeUs;
+		if (width == 0) {
+			hasLast = true;
+			return;
+		}
+		if (size < (uint64_t)offset + width) {
+			current.malformed++;
+			return;
+		}
+		uint64_t seq = 0;
+		for (uint32_t i = 0; i < width; i++)
+			seq |= (uint64_t)buf[offset + i] << (8 * i);
+		seq %= wrap;
+		if (!hasLast) {
+			hasLast = true;
+			lastSeq = seq;
+			return;
+		}
+		const uint64_t step = (seq + wrap - lastSeq) % wrap;
+		if (step == 0)
+			current.duplicates++;
+		else if (step < wrap / 2) {
+			if (step > 1) {
+				current.gaps++;
+				current.lost += step - 1;
+			}
+			lastSeq = seq;
+		}
+		else if (wrap - step <= REORDER_WINDOW) {
+			current.reordered++;
+			if (current.lost > 0)
+				current.lost--;
+		}
+		else {
+			current.discontinuities++;
+			lastSeq = seq;
+		}
+	}
+
+	StreamStats stats() {
+		std::lock_guard guard(lock);
+		StreamStats result = current;
+		const uint64_t intervals = current.received > 1 ? current.received - 1 : 0;
+		result.meanIntervalUs = intervals > 0 ? (uint32_t)(totalIntervalUs / intervals) : 0;
+		return result;
+	}
+
+private:
+	void addInterval(int64_t intervalUs) {
+		const uint64_t interval = intervalUs > 0 ? (uint64_t)intervalUs : 0;
+		totalIntervalUs += interval;
+		if (interval > current.maxIntervalUs)
+			current.maxIntervalUs = (uint32_t)(interval < UINT32_MAX ? interval : UINT32_MAX);
+		if (expectedIntervalUs == 0)
+			return;
+		// bucket bounds of the histogram in quarters of the expected interval
+		static const uint64_t BOUNDS[] = { 2, 3, 5, 6, 8, 16, 32 };
+		const uint64_t quarters = interval * 4 / expectedIntervalUs;
+		int bucket = 0;
+		while (bucket < 7 && quarters >= BOUNDS[bucket])
+			bucket++;
+		current.intervalHistogram[bucket]++;
+	}
+
+	std::mutex lock;
+	std::atomic<bool> configured = false;
+	uint32_t offset = 0;
+	uint32_t width = 0;
+	uint64_t wrap = 1;
+	uint32_t expectedIntervalUs = 0;
+	StreamStats current = { };
+	bool hasLast = false;
+	uint64_t lastSeq = 0;
+	int64_t lastTimeUs = 0;
+	uint64_t totalIntervalUs = 0;
+};
+
+template <class TCharacteristic>
+struct CharacteristicCacheEntryT {
+	TCharacteristic characteristic = nullptr;
+};
+template <class TService, class TCharacteristic>
+struct ServiceCacheEntryT {
+	TService service = nullptr;
+	std::map<long, CharacteristicCacheEntryT<TCharacteristic>> characteristics = { };
+};
+template <class TDevice, class TService, class TCharacteristic>
+struct DeviceCacheEntryT {
+	TDevice device = nullptr;
+	std::map<long, ServiceCacheEntryT<TService, TCharacteristic>> services = { };
+};
+
+// Looks up a characteristic without inserting empty entries on the way. Caller must hold the cache lock.
+template <class TDevice, class TService, class TCharacteristic>
+CharacteristicCacheEntryT<TCharacteristic>* findCachedCharacteristic(std::map<long, DeviceCacheEntryT<TDevice, TService, TCharacteristic>>& cache,
+	const wchar_t* deviceId, const wchar_t* serviceId, const wchar_t* characteristicId)
+{
+	auto device = cache.find(hsh(deviceId));
+	if (device == cache.end())
+		return nullptr;
+	auto service = device->second.services.find(hsh(serviceId));
+	if (service == device->second.services.end())
+		return nullptr;
+	auto characteristic = service->second.characteristics.find(hsh(characteristicId));
+	if (characteristic == service->second.characteristics.end())
+		return nullptr;
+	return &characteristic->second;
+}
+
+// Ring buffer that every registered consumer reads with its own cursor. Producers serialize on writeLock, consumers
+// don't take any lock unless they block, so a slow consumer never holds up the producers or the other consumers.
+// Instead it is overrun: its cursor jumps to the oldest item still in the ring and the skipped items are counted.
+// Every slot is guarded by a sequence number, 2n+1 while item n is written and 2n+2 afterwards.
+template <class T>
+class BroadcastRing {
+public:
+	static const int MAX_CONSUMERS = 8;
+
+	// Returns false while consumers are registered. A consumer that was just unregistered may still be inside pop,
+	// so replaced slot arrays are only freed once no pop is running.
+	bool reset(size_t newCapacity) {
+		std::lock_guard guard(writeLock);
+		for (auto& consumer : consumers)
+			if (consumer.used)
+				return false;
+		if (newCapacity > 0) {
+			rings.push_back(std::make_unique<Ring>(newCapacity));
+			ring = rings.back().get();
+		}
+		else
+			ring = nullptr;
+		head = 0;
+		if (readers == 0)
+			rings.erase(rings.begin(), rings.end() - (ring != nullptr ? 1 : 0));
+		return true;
+	}
+
+	bool enabled() const {
+		return ring.load() != nullptr;
+	}
+
+	void push(const T& item) {
+		{
+			std::lock_guard guard(writeLock);
+			Ring* r = ring.load(std::memory_order_relaxed);
+			if (r == nullptr)
+				return;
+			const uint64_t n = head.load(std::memory_order_relaxed);
+			Slot& slot = r->slots[n % r->capacity];
+			slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			slot.item = item;
+			slot.seq.store(2 * n + 2, std::memory_order_release);
+			head.store(n + 1);
+		}
+		if (waiters > 0) {
+			std::lock_guard guard(waitLock);
+			signal.notify_all();
+		}
+	}
+
+	// Returns -1 if all consumer slots are taken. The consumer starts with the next item pushed.
+	int addConsumer() {
+		std::lock_guard guard(writeLock);
+		for (int i = 0; i < MAX_CONSUMERS; i++) {
+			if (!consumers[i].used) {
+				consumers[i].next = head.load();
+				consumers[i].overruns = 0;
+				consumers[i].used = true;
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	void removeConsumer(int consumer) {
+		if (consumer >= 0 && consumer < MAX_CONSUMERS)
+			consumers[consumer].used = false;
+		wake();
+	}
+
+	void removeConsumers() {
+		for (auto& consumer : consumers)
+			consumer.used = false;
+		wake();
+	}
+
+	// Each consumer must be polled from one thread at a time. In blocking mode waits until an item is available or quit is set.
+	bool pop(int consumer, T* item, bool block, const std::atomic<bool>& quit) {
+		if (consumer < 0 || consumer >= MAX_CONSUMERS)
+			return false;
+		// keeps reset from freeing the ring this pop reads from
+		readers++;
+		const bool result = popFrom(consumers[consumer], item, block, quit);
+		readers--;
+		return result;
+	}
+
+	// number of items the consumer has not read yet and number of items it missed
+	void stats(int consumer, uint64_t* lag, uint64_t* overruns) const {
+		*lag = *overruns = 0;
+		if (consumer < 0 || consumer >= MAX_CONSUMERS || !consumers[consumer].used)
+			return;
+		const uint64_t available = head.load();
+		const uint64_t next = consumers[consumer].next.load(std::memory_order_relaxed);
+		*lag = available > next ? available - next : 0;
+		*overruns = consumers[consumer].overruns.load(std::memory_order_relaxed);
+	}
+
+	// releases blocked consumers, e.g. after quit was set or the consumer was removed
+	void wake() {
+		std::lock_guard guard(waitLock);
+		signal.notify_all();
+	}
+
+private:
+	struct Slot {
+		std::atomic<uint64_t> seq{ 0 };
+		T item;
+	};
+	struct Ring {
+		explicit Ring(size_t capacity) : slots(new Slot[capacity]), capacity(capacity) { }
+		std::unique_ptr<Slot[]> slots;
+		const size_t capacity;
+	};
+	struct Consumer {
+		std::atomic<bool> used{ false };
+		std::atomic<uint64_t> next{ 0 };
+		std::atomic<uint64_t> overruns{ 0 };
+	};
+
+	bool popFrom(Consumer& c, T* item, bool block, const std::atomic<bool>& quit) {
+		while (c.used) {
+			// the ring and the head are only replaced while no consumer is registered
+			const Ring* r = ring.load();
+			if (r == nullptr)
+				return false;
+			const uint64_t available = head.load();
+			uint64_t next = c.next.load(std::memory_order_relaxed);
+			if (next >= available) {
+				if (!block || quit)
+					return false;
+				waiters++;
+				{
+					std::unique_lock<std::mutex> guard(waitLock);
+					signal.wait(guard, [&] { return head.load() > next || quit || !c.used; });
+				}
+				waiters--;
+				continue;
+			}
+			if (available - next > r->capacity) {
+				c.overruns.fetch_add(available - r->capacity - next, std::memory_order_relaxed);
+				next = available - r->capacity;
+			}
+			const Slot& slot = r->slots[next % r->capacity];
+			const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+			if (seq == 2 * next + 2) {
+				*item = slot.item;
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.seq.load(std::memory_order_relaxed) == seq) {
+					c.next.store(next + 1, std::memory_order_relaxed);
+					return true;
+				}
+			}
+			// overwritten while reading, skip it
+			c.overruns.fetch_add(1, std::memory_order_relaxed);
+			c.next.store(next + 1, std::memory_order_relaxed);
+		}
+		return false;
+	}
+
+	// rings that may still be read by a pop, the current one is the last
+	std::vector<std::unique_ptr<Ring>> rings;
+	std::atomic<Ring*> ring{ nullptr };
+	std::mutex writeLock;
+	std::atomic<uint64_t> head{ 0 };
+	Consumer consumers[MAX_CONSUMERS];
+	std::atomic<int> readers{ 0 };
+
+	std::mutex waitLock;
+	std::condition_variable signal;
+	std::atomic<int> waiters{ 0 };
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+// Plain structs shared with the managed side. Kept free of windows/winrt headers so that the
+// benchmarks in /bench can be built on other platforms, too.
+
+#include <cstdint>
+#include <cwchar>
+
+struct DeviceUpdate {
+	wchar_t id[256];
+	bool isConnectable = false;
+	wchar_t name[256];
+	uint8_t advData[32];
+	uint32_t advDataLen;
+};
+
+struct Service {
+	wchar_t uuid[100];
+};
+
+struct Characteristic {
+	wchar_t uuid[100];
+	wchar_t userDescription[100];
+};
+
+struct BLEData {
+	uint8_t buf[512];
+	uint16_t size;
+	wchar_t deviceId[256];
+	wchar_t serviceUuid[256];
+	wchar_t characteristicUuid[256];
+};
+
+struct ErrorMessage {
+	wchar_t msg[1024];
+};
+
+struct ConsumerStats {
+	uint64_t lag;
+	uint64_t overruns;
+};
+
+struct ReconnectStats {
+	uint32_t disconnects;
+	uint32_t reconnects;
+	uint32_t failedAttempts;
+	// time from the loss of the connection until the subscriptions were restored
+	uint32_t lastRecoveryMs;
+	uint32_t maxRecoveryMs;
+	uint64_t totalRecoveryMs;
+};
+
+struct StreamStats {
+	uint64_t received;
+	// frames missing in the sequence and the number of jumps they were missed in
+	uint64_t lost;
+	uint64_t gaps;
+	uint64_t duplicates;
+	uint64_t reordered;
+	// steps back beyond the reorder window, e.g. the device restarted its counter
+	uint64_t discontinuities;
+	// too short to contain the sequence field
+	uint64_t malformed;
+	uint32_t meanIntervalUs;
+	uint32_t maxIntervalUs;
+	// inter-arrival times relative to the expected interval: <0.5, <0.75, <1.25, <1.5, <2, <4, <8, >=8
+	uint64_t intervalHistogram[8];
+};
+
+// Opaque reference to a resolved characteristic, see ResolveCharacteristic.
+struct CharacteristicHandle;
+
+enum class OperationType : uint32_t { CONNECT, DISCOVER, SUBSCRIBE, READ, WRITE };
+
+// result of an operation started with one of the Begin functions, see PollCompletions
+struct Completion {
+	uint64_t id;
+	OperationType type;
+	bool success;
+	// GattCommunicationStatus of a failed gatt request, -1 if the operation failed before or without one
+	int32_t status;
+	// resolved characteristic of DISCOVER, to be released with ReleaseCharacteristic
+	CharacteristicHandle* handle;
+	// value of READ
+	uint8_t buf[512];
+	uint16_t size;
+};
+
+enum class ScanStatus { PROCESSING, AVAILABLE, FINISHED };
+
+enum SendFlags : uint32_t {
+	SEND_BLOCK = 1,
+	SEND_WITH_RESPONSE = 2,
+};
@@ -2,9 +2,11 @@
 //
 
 #include "stdafx.h"
-#include <future>
+#include <random>
+#include <thread>
 
 #include "BleWinrtDll.h"
+#include "BleCore.h"
 
 #pragma comment(lib, "windowsapp")
 
@@ -24,10 +26,14 @@ using namespace winrt::Windows::Devices::Enumeration;
 
 using namespace winrt::Windows::Storage::Streams;
 
-DebugLogCallback* logger = nullptr;
+// Detach unregisters the callback while other threads log, it waits until the calls in flight have returned
+atomic<DebugLogCallback*> logger = nullptr;
+atomic<int> loggerCalls = 0;
 void Log(const char* s) {
-	if (logger)
-		(*logger)(s);
+	loggerCalls++;
+	if (auto callback = logger.load())
+		callback(s);
+	loggerCalls--;
 }
 
 string convert_to_string(const wstring& wstr)
@@ -41,8 +47,8 @@ string convert_to_string(const wstring& wstr)
 }
 
 void Log(const wstring& s) {
-	if (logger)
-		(*logger)(convert_to_string(s).c_str());
+	if (logger.load() != nullptr)
+		Log(convert_to_string(s).c_str());
 }
 
 union to_guid
@@ -51,38 +57,10 @@ union to_guid
 	winrt::guid guid;
 };
 
-const uint8_t BYTE_ORDER[] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
-
 winrt::guid make_guid(const wchar_t* value)
 {
 	to_guid to_guid;
-	memset(&to_guid, 0, sizeof(to_guid));
-	int offset = 0;
-	for (int i = 0; i < (int)wcslen(value); i++) {
-		if (value[i] >= '0' && value[i] <= '9')
-		{
-			uint8_t digit = value[i] - '0';
-			to_guid.buf[BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
-			offset++;
-		}
-		else if (value[i] >= 'A' && value[i] <= 'F')
-		{
-			uint8_t digit = 10 + value[i] - 'A';
-			to_guid.buf[BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
-			offset++;
-		}
-		else if (value[i] >= 'a' && value[i] <= 'f')
-		{
-			uint8_t digit = 10 + value[i] - 'a';
-			to_guid.buf[BYTE_ORDER[offset / 2]] += offset % 2 == 0 ? digit << 4 : digit;
-			offset++;
-		}
-		else
-		{
-			// skip char
-		}
-	}
-
+	parse_uuid(value, to_guid.buf);
 	return to_guid.guid;
 }
 
@@ -95,31 +73,15 @@ winrt::guid make_guid(const wchar_t* value)
 
 mutex errorLock;
 wchar_t last_error[2048];
-struct CharacteristicCacheEntry {
-	GattCharacteristic characteristic = nullptr;
-};
-struct ServiceCacheEntry {
-	GattDeviceService service = nullptr;
-	map<long, CharacteristicCacheEntry> characteristics = { };
-};
-struct DeviceCacheEntry {
-	BluetoothLEDevice device = nullptr;
-	map<long, ServiceCacheEntry> services = { };
-};
+using CharacteristicCacheEntry = CharacteristicCacheEntryT<GattCharacteristic>;
+using ServiceCacheEntry = ServiceCacheEntryT<GattDeviceService, GattCharacteristic>;
+using DeviceCacheEntry = DeviceCacheEntryT<BluetoothLEDevice, GattDeviceService, GattCharacteristic>;
 // Seems like a very necessary lock... but could not get it working :(
 mutex cacheLock;
 map<long, DeviceCacheEntry> cache;
 
-
-// using hashes of uuids to omit storing the c-strings in reliable storage
-long hsh(const wchar_t* wstr)
-{
-	long hash = 5381;
-	int c;
-	while (c = *wstr++)
-		hash = ((hash << 5) + hash) + c;
-	return hash;
-}
+// registers the device for automatic reconnection, see RecoverDeviceAsync
+void watchConnection(const wchar_t* deviceId, BluetoothLEDevice const& device);
 
 void clearError() {
 	lock_guard error_lock(errorLock);
@@ -155,6 +117,7 @@ IAsyncOperation<BluetoothLEDevice> retrieveDevice(const wchar_t* deviceId) {
 		try {
 			clearError();
 			co_await chrono::seconds(1);
+			watchConnection(deviceId, result);
 			{
 				lock_guard lock(cacheLock);
 				cache[hsh(deviceId)] = { result };
@@ -209,10 +172,10 @@ IAsyncOperation<GattCharacteristic> retrieveCharacteristic(const wchar_t* device
 
 	{
 		lock_guard lock(cacheLock);
-		if (cache[hsh(deviceId)].services[hsh(serviceId)].characteristics.count(hsh(characteristicId)))
+		if (auto entry = findCachedCharacteristic(cache, deviceId, serviceId, characteristicId))
 		{
 			Log("Cached characteristic");
-			co_return cache[hsh(deviceId)].services[hsh(serviceId)].characteristics[hsh(characteristicId)].characteristic;
+			co_return entry->characteristic;
 		}
 	}
 	GattCharacteristicsResult result = co_await service.GetCharacteristicsForUuidAsync(make_guid(characteristicId), BluetoothCacheMode::Cached);
@@ -261,16 +224,147 @@ atomic<bool> quitFlag = false;
 struct Subscription {
 	GattCharacteristic characteristic = nullptr;
 	GattCharacteristic::ValueChanged_revoker revoker;
+	// to restore the subscription after a reconnect
+	wstring deviceId;
+	wstring serviceId;
+	wstring characteristicId;
+	// kept across reconnects, so gaps during the reconnect are counted
+	shared_ptr<StreamAnalyzer> analyzer;
+	// the connection was lost and the handler is revoked until RecoverDeviceAsync or a new subscribe restores it
+	bool recovering = false;
 	template <class A, class B>
-	Subscription(A&& a, B&& b) : characteristic(std::forward<A>(a)), revoker(std::forward<B>(b)) { }
+	Subscription(A&& a, B&& b, shared_ptr<StreamAnalyzer> analyzer, wstring deviceId, wstring serviceId, wstring characteristicId) : characteristic(std::forward<A>(a)), revoker(std::forward<B>(b)),
+		deviceId(move(deviceId)), serviceId(move(serviceId)), characteristicId(move(characteristicId)), analyzer(move(analyzer)) { }
 };
 list<Subscription> subscriptions;
 mutex subscribeQueueLock;
-condition_variable subscribeQueueSignal;
 
-queue<BLEData> dataQueue{};
-mutex dataQueueLock;
-condition_variable dataQueueSignal;
+// Matches by ids, the characteristic object changes with every reconnect. The caller holds subscribeQueueLock.
+list<Subscription>::iterator findSubscription(const wchar_t* deviceId, const wchar_t* serviceId, const wchar_t* characteristicId) {
+	const auto device = hsh(deviceId);
+	const auto service = make_guid(serviceId);
+	const auto characteristic = make_guid(characteristicId);
+	return find_if(subscriptions.begin(), subscriptions.end(), [&](const auto& s) {
+		return hsh(s.deviceId.c_str()) == device && make_guid(s.serviceId.c_str()) == service && make_guid(s.characteristicId.c_str()) == characteristic;
+	});
+}
+
+SignalQueue<BLEData> dataQueue;
+BroadcastRing<BLEData> broadcast;
+
+// hands a notification or read value to the consumers
+void deliverData(const BLEData& data) {
+	if (broadcast.enabled())
+		broadcast.push(data);
+	else
+		dataQueue.push(data);
+}
+
+// Every operation reports its result to a target: the completion queue for Begin calls, the waiter of a blocking call,
+// or nobody for a non-blocking legacy call. The waiter is shared with the coroutine, so a caller that returned early
+// because of Quit doesn't leave a dangling pointer behind, the result then is discarded.
+struct Waiter {
+	mutex lock;
+	condition_variable signal;
+	bool done = false;
+	bool abandoned = false;
+	Completion completion;
+};
+struct OperationTarget {
+	uint64_t id = 0;
+	// completions of an operation started before the last Quit or Detach are dropped, see releasePollers
+	uint64_t session = 0;
+	shared_ptr<Waiter> waiter;
+};
+
+SignalQueue<Completion> completionQueue;
+// changed under the lock of the completion queue whenever it is drained
+atomic<uint64_t> completionSession = 0;
+atomic<uint64_t> nextOperationId = 1;
+
+// blocked calls, woken by releasePollers
+mutex waitersLock;
+list<shared_ptr<Waiter>> waiters;
+
+OperationTarget queuedTarget() {
+	OperationTarget target;
+	target.id = nextOperationId++;
+	target.session = completionSession;
+	return target;
+}
+
+OperationTarget waitingTarget() {
+	OperationTarget target;
+	target.waiter = make_shared<Waiter>();
+	return target;
+}
+
+Completion makeCompletion(OperationType type) {
+	Completion completion{};
+	completion.type = type;
+	completion.status = -1;
+	return completion;
+}
+
+// releases what a completion owns if nobody is going to receive it
+void discardCompletion(const Completion& completion) {
+	if (completion.handle != nullptr)
+		ReleaseCharacteristic(completion.handle);
+}
+
+void complete(const OperationTarget& target, Completion& completion) {
+	completion.id = target.id;
+	if (completion.success)
+		completion.status = 0;
+	if (target.waiter != nullptr) {
+		{
+			lock_guard lock(target.waiter->lock);
+			if (!target.waiter->abandoned) {
+				target.waiter->completion = completion;
+				target.waiter->done = true;
+				target.waiter->signal.notify_one();
+				return;
+			}
+		}
+		discardCompletion(completion);
+	}
+	else if (target.id != 0) {
+		{
+			// checked under the lock that releasePollers drains with, so a completion can't slip in behind the drain
+			lock_guard lock(completionQueue.lock);
+			if (!quitFlag && target.session == completionSession) {
+				completionQueue.items.push(completion);
+				completionQueue.signal.notify_one();
+				return;
+			}
+		}
+		discardCompletion(completion);
+	}
+	else
+		discardCompletion(completion);
+}
+
+// returns false if Quit was called before the operation completed
+bool waitForCompletion(const OperationTarget& target, Completion* completion) {
+	list<shared_ptr<Waiter>>::iterator registered;
+	{
+		lock_guard lock(waitersLock);
+		registered = waiters.insert(waiters.end(), target.waiter);
+	}
+	bool done;
+	{
+		unique_lock<mutex> lock(target.waiter->lock);
+		target.waiter->signal.wait(lock, [&] { return target.waiter->done || quitFlag; });
+		done = target.waiter->done;
+		if (done)
+			*completion = target.waiter->completion;
+		else
+			target.waiter->abandoned = true;
+	}
+	lock_guard lock(waitersLock);
+	waiters.erase(registered);
+	return done;
+}
 
 bool QuittableWait(condition_variable& signal, unique_lock<mutex>& waitLock) {
 	{
@@ -521,42 +615,132 @@ ScanStatus PollCharacteristic(Characteristic* characteristic, bool block) {
 	return res;
 }
 
-void Characteristic_ValueChanged(GattCharacteristic const& characteristic, GattValueChangedEventArgs args)
+void buildAndDeliver(GattCharacteristic const& characteristic, IBuffer const& value)
 {
-	// Log(L"Characteristic_ValueChanged " + wstring(to_hstring(characteristic.Uuid()).c_str()));
 	BLEData data;
-	wcscpy_s(data.characteristicUuid, sizeof(data.characteristicUuid) / sizeof(wchar_t), to_hstring(characteristic.Uuid()).c_str());
-	wcscpy_s(data.serviceUuid, sizeof(data.serviceUuid) / sizeof(wchar_t), to_hstring(characteristic.Service().Uuid()).c_str());
-	wcscpy_s(data.deviceId, sizeof(data.deviceId) / sizeof(wchar_t), characteristic.Service().Device().DeviceId().c_str());
-
-	data.size = args.CharacteristicValue().Length();
+	const auto service = characteristic.Service();
 	// IBuffer to array, copied from https://stackoverflow.com/a/55974934
-	memcpy(data.buf, args.CharacteristicValue().data(), data.size);
+	fill_data(data, service.Device().DeviceId().c_str(), to_hstring(service.Uuid()).c_str(), to_hstring(characteristic.Uuid()).c_str(),
+		value.data(), value.Length());
 
 	{
 		if (quitFlag)
 			return;
 	}
-	{
-		lock_guard queueGuard(dataQueueLock);
-		dataQueue.push(data);
-		dataQueueSignal.notify_one();
-	}
+	deliverData(data);
 }
 
-winrt::fire_and_forget SubscribeCharacteristicAsync(unique_ptr<wstring> deviceId, unique_ptr<wstring> serviceId, unique_ptr<wstring> characteristicId, bool* result) {
+// With the dispatcher running, the threadpool thread of the event only queues the references and the dispatcher thread
+// does the rest, see StartDispatcher.
+struct RawNotification {
+	GattCharacteristic characteristic = nullptr;
+	IBuffer value = nullptr;
+};
+DispatchThread<RawNotification> dispatcher;
+atomic<bool> dispatcherEnabled = false;
+
+void Characteristic_ValueChanged(GattCharacteristic const& characteristic, GattValueChangedEventArgs args)
+{
+	// Log(L"Characteristic_ValueChanged " + wstring(to_hstring(characteristic.Uuid()).c_str()));
+	// a notification that races with StopDispatcher is delivered here instead of being left in the stopped queue
+	if (!dispatcherEnabled || !dispatcher.post({ characteristic, args.CharacteristicValue() }))
+		buildAndDeliver(characteristic, args.CharacteristicValue());
+}
+
+// time of the last notification per device, lets the read scheduler give way to notifications without a shared lock
+mutex activityLock;
+map<long, shared_ptr<atomic<int64_t>>> notificationActivity;
+
+shared_ptr<atomic<int64_t>> activityOf(long device) {
+	lock_guard lock(activityLock);
+	auto& activity = notificationActivity[device];
+	if (activity == nullptr)
+		activity = make_shared<atomic<int64_t>>(0);
+	return activity;
+}
+
+// the analyzer sees every notification on the event thread, also with the dispatcher running
+GattCharacteristic::ValueChanged_revoker registerValueChanged(GattCharacteristic const& characteristic, const wstring& deviceId, shared_ptr<StreamAnalyzer> analyzer) {
+	auto activity = activityOf(hsh(deviceId.c_str()));
+	return characteristic.ValueChanged(winrt::auto_revoke, [analyzer, activity](GattCharacteristic const& sender, GattValueChangedEventArgs const& args) {
+		activity->store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+		const auto value = args.CharacteristicValue();
+		// DateTime counts in 100 ns
+		analyzer->update(value.data(), value.Length(), args.Timestamp().time_since_epoch().count() / 10);
+		Characteristic_ValueChanged(sender, args);
+	});
+}
+
+mutex dispatcherLock;
+
+bool StartDispatcher(int32_t priority, uint64_t affinityMask) {
+	lock_guard lock(dispatcherLock);
+	if (dispatcher.running())
+		return false;
+	Log(L"StartDispatcher priority " + to_wstring(priority));
+	dispatcher.start([priority, affinityMask]() {
+		// the handler calls into winrt, don't rely on another thread keeping the implicit MTA alive
+		winrt::init_apartment(winrt::apartment_type::multi_threaded);
+		if (!SetThreadPriority(GetCurrentThread(), priority))
+			saveError(L"%s:%d Could not set dispatcher priority %d", __WFILE__, __LINE__, priority);
+		if (affinityMask != 0 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)affinityMask) == 0)
+			saveError(L"%s:%d Could not set dispatcher affinity %llx", __WFILE__, __LINE__, affinityMask);
+	}, [](const RawNotification& notification) {
+		try {
+			buildAndDeliver(notification.characteristic, notification.value);
+		}
+		catch (winrt::hresult_error& ex)
+		{
+			saveError(L"%s:%d Dispatcher catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+		}
+	});
+	dispatcherEnabled = true;
+	return true;
+}
+
+void StopDispatcher() {
+	lock_guard lock(dispatcherLock);
+	dispatcherEnabled = false;
+	dispatcher.stop();
+}
+
+winrt::fire_and_forget SubscribeCharacteristicAsync(wstring deviceId, wstring serviceId, wstring characteristicId, OperationTarget target) {
 	Log("SubscribeCharacteristicAsync");
+	auto completion = makeCompletion(OperationType::SUBSCRIBE);
 	try {
-		auto characteristic = co_await retrieveCharacteristic(deviceId->c_str(), serviceId->c_str(), characteristicId->c_str());
+		auto characteristic = co_await retrieveCharacteristic(deviceId.c_str(), serviceId.c_str(), characteristicId.c_str());
+		bool subscribed = false;
 		if (characteristic != nullptr) {
+			lock_guard lock(subscribeQueueLock);
+			auto subscription = findSubscription(deviceId.c_str(), serviceId.c_str(), characteristicId.c_str());
+			subscribed = subscription != subscriptions.end() && !subscription->recovering;
+		}
+		if (characteristic != nullptr && subscribed) {
+			// e.g. kept alive by Detach, the CCCD is still written
+			Log("Already subscribed");
+			completion.success = true;
+		}
+		else if (characteristic != nullptr) {
 			auto status = co_await characteristic.WriteClientCharacteristicConfigurationDescriptorAsync(GattClientCharacteristicConfigurationDescriptorValue::Notify);
+			completion.status = (int32_t)status;
 			if (status != GattCommunicationStatus::Success)
-				saveError(L"%s:%d Error subscribing to characteristic with uuid %s and status %d", __WFILE__, __LINE__, *characteristicId, status);
+				saveError(L"%s:%d Error subscribing to characteristic with uuid %s and status %d", __WFILE__, __LINE__, characteristicId.c_str(), status);
 			else {
 				Log("Subscription successful");
-				subscriptions.emplace_back(characteristic, characteristic.ValueChanged(winrt::auto_revoke, &Characteristic_ValueChanged));
-				if (result != nullptr)
-					*result = true;
+				lock_guard lock(subscribeQueueLock);
+				// subscribe calls no longer wait for each other, another one may have been faster
+				auto subscription = findSubscription(deviceId.c_str(), serviceId.c_str(), characteristicId.c_str());
+				if (subscription == subscriptions.end()) {
+					auto analyzer = make_shared<StreamAnalyzer>();
+					subscriptions.emplace_back(characteristic, registerValueChanged(characteristic, deviceId, analyzer), analyzer, deviceId, serviceId, characteristicId);
+				}
+				else if (subscription->recovering) {
+					// takes over from the recovery, which leaves it alone from now on
+					subscription->characteristic = characteristic;
+					subscription->revoker = registerValueChanged(characteristic, deviceId, subscription->analyzer);
+					subscription->recovering = false;
+				}
+				completion.success = true;
 			}
 		}
 	}
@@ -564,66 +748,810 @@ winrt::fire_and_forget SubscribeCharacteristicAsync(unique_ptr<wstring> deviceId
 	{
 		saveError(L"%s:%d SubscribeCharacteristicAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
 	}
-	subscribeQueueSignal.notify_one();
+	complete(target, completion);
 }
 /* */
 bool SubscribeCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, bool block) {
 	Log(L"SubsctribeCharacteristic " + wstring(characteristicId));
-	unique_lock<mutex> lock(subscribeQueueLock);
-	bool result = false;
-	SubscribeCharacteristicAsync(make_unique<wstring>(deviceId), make_unique<wstring>(serviceId), make_unique<wstring>(characteristicId), block ? &result : 0);
-	if (block && QuittableWait(subscribeQueueSignal, lock))
+	if (!block) {
+		SubscribeCharacteristicAsync(deviceId, serviceId, characteristicId, {});
+		return false;
+	}
+	const auto target = waitingTarget();
+	SubscribeCharacteristicAsync(deviceId, serviceId, characteristicId, target);
+	Completion completion;
+	return waitForCompletion(target, &completion) && completion.success;
+}
+
+shared_ptr<StreamAnalyzer> findAnalyzer(const wchar_t* deviceId, const wchar_t* serviceId, const wchar_t* characteristicId) {
+	lock_guard lock(subscribeQueueLock);
+	auto subscription = findSubscription(deviceId, serviceId, characteristicId);
+	return subscription != subscriptions.end() ? subscription->analyzer : nullptr;
+}
+
+bool ConfigureStreamAnalyzer(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, uint32_t offset, uint32_t width, uint32_t wrap, uint32_t expectedIntervalUs) {
+	auto analyzer = findAnalyzer(deviceId, serviceId, characteristicId);
+	if (analyzer == nullptr) {
+		saveError(L"%s:%d No subscription for characteristic %s", __WFILE__, __LINE__, characteristicId);
 		return false;
+	}
+	if ((size_t)offset + width > sizeof(BLEData::buf)) {
+		saveError(L"%s:%d Sequence field at %u with width %u is outside of the payload", __WFILE__, __LINE__, offset, width);
+		return false;
+	}
+	if (!analyzer->configure(offset, width, wrap, expectedIntervalUs)) {
+		saveError(L"%s:%d Sequence field with width %u can't count modulo %u", __WFILE__, __LINE__, width, wrap);
+		return false;
+	}
+	return true;
+}
 
-	return result;
+bool GetStreamStats(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, StreamStats* stats) {
+	auto analyzer = findAnalyzer(deviceId, serviceId, characteristicId);
+	if (analyzer == nullptr)
+		return false;
+	*stats = analyzer->stats();
+	return true;
 }
 
 bool PollData(BLEData* data, bool block) {
-	unique_lock<mutex> lock(dataQueueLock);
-	if (block && dataQueue.empty())
-		if (QuittableWait(dataQueueSignal, lock))
-			return false;
-	if (!dataQueue.empty()) {
-		*data = dataQueue.front();
-		dataQueue.pop();
-		return true;
+	return dataQueue.pop(data, block, quitFlag);
+}
+
+bool EnableBroadcast(uint32_t capacity) {
+	Log(L"EnableBroadcast " + to_wstring(capacity));
+	if (!broadcast.reset(capacity)) {
+		saveError(L"%s:%d EnableBroadcast: unregister all consumers first", __WFILE__, __LINE__);
+		return false;
+	}
+	return true;
+}
+
+int32_t RegisterConsumer() {
+	return broadcast.addConsumer();
+}
+
+void UnregisterConsumer(int32_t consumer) {
+	broadcast.removeConsumer(consumer);
+}
+
+bool PollBroadcast(int32_t consumer, BLEData* data, bool block) {
+	return broadcast.pop(consumer, data, block, quitFlag);
+}
+
+void GetConsumerStats(int32_t consumer, ConsumerStats* stats) {
+	broadcast.stats(consumer, &stats->lag, &stats->overruns);
+}
+
+IBuffer makeBuffer(const uint8_t* data, uint32_t size) {
+	Buffer buffer(size);
+	memcpy(buffer.data(), data, size);
+	buffer.Length(size);
+	return buffer;
+}
+
+winrt::fire_and_forget WriteCharacteristicAsync(GattCharacteristic characteristic, IBuffer buffer, GattWriteOption option, OperationTarget target) {
+	auto completion = makeCompletion(OperationType::WRITE);
+	try {
+		auto status = co_await characteristic.WriteValueAsync(buffer, option);
+		completion.status = (int32_t)status;
+		if (status != GattCommunicationStatus::Success)
+			saveError(L"%s:%d Error writing value to characteristic with uuid %s", __WFILE__, __LINE__, to_hstring(characteristic.Uuid()).c_str());
+		else
+			completion.success = true;
+	}
+	catch (winrt::hresult_error& ex)
+	{
+		saveError(L"%s:%d WriteCharacteristicAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
 	}
-	return false;
+	complete(target, completion);
 }
 
-winrt::fire_and_forget SendDataAsync(unique_ptr<BLEData> data, condition_variable* signal, bool* result) {
+winrt::fire_and_forget SendDataAsync(unique_ptr<BLEData> data, OperationTarget target) {
 	try {
 		auto characteristic = co_await retrieveCharacteristic(data->deviceId, data->serviceUuid, data->characteristicUuid);
 		if (characteristic != nullptr) {
-			// create IBuffer from data
-			DataWriter writer;
-			writer.WriteBytes(winrt::array_view<uint8_t const>(data->buf, data->buf + data->size));
-			IBuffer buffer = writer.DetachBuffer();
-			auto status = co_await characteristic.WriteValueAsync(buffer, GattWriteOption::WriteWithoutResponse);
-			if (status != GattCommunicationStatus::Success)
-				saveError(L"%s:%d Error writing value to characteristic with uuid %s", __WFILE__, __LINE__, data->characteristicUuid);
-			else if (result != 0)
-				*result = true;
+			WriteCharacteristicAsync(characteristic, makeBuffer(data->buf, data->size), GattWriteOption::WriteWithoutResponse, move(target));
+			co_return;
 		}
 	}
 	catch (winrt::hresult_error& ex)
 	{
 		saveError(L"%s:%d SendDataAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
 	}
-	if (signal != 0)
-		signal->notify_one();
+	auto completion = makeCompletion(OperationType::WRITE);
+	complete(target, completion);
 }
 bool SendData(BLEData* data, bool block) {
-	mutex _mutex;
-	unique_lock<mutex> lock(_mutex);
-	condition_variable signal;
-	bool result = false;
-	// copy data to stack so that caller can free its memory in non-blocking mode
-	SendDataAsync(make_unique<BLEData>(*data), block ? &signal : 0, block ? &result : 0);
-	if (block)
-		signal.wait(lock);
+	// copy data to heap so that caller can free its memory in non-blocking mode
+	if (!block) {
+		SendDataAsync(make_unique<BLEData>(*data), {});
+		return false;
+	}
+	const auto target = waitingTarget();
+	SendDataAsync(make_unique<BLEData>(*data), target);
+	Completion completion;
+	return waitForCompletion(target, &completion) && completion.success;
+}
+
+struct CharacteristicHandle {
+	// replaced after a reconnect, hence the lock
+	GattCharacteristic characteristic = nullptr;
+	mutex lock;
+	wstring deviceId;
+	wstring serviceId;
+	wstring characteristicId;
+};
+// all handles that were not released yet, to update them after a reconnect
+list<CharacteristicHandle*> handles;
+mutex handlesLock;
+
+GattCharacteristic characteristicOf(CharacteristicHandle* handle) {
+	lock_guard lock(handle->lock);
+	return handle->characteristic;
+}
+
+winrt::fire_and_forget ResolveCharacteristicAsync(wstring deviceId, wstring serviceId, wstring characteristicId, OperationTarget target) {
+	auto completion = makeCompletion(OperationType::DISCOVER);
+	try {
+		auto characteristic = co_await retrieveCharacteristic(deviceId.c_str(), serviceId.c_str(), characteristicId.c_str());
+		if (characteristic != nullptr) {
+			auto handle = new CharacteristicHandle();
+			handle->characteristic = characteristic;
+			handle->deviceId = deviceId;
+			handle->serviceId = serviceId;
+			handle->characteristicId = characteristicId;
+			{
+				lock_guard lock(handlesLock);
+				handles.push_back(handle);
+			}
+			completion.handle = handle;
+			completion.success = true;
+		}
+	}
+	catch (winrt::hresult_error& ex)
+	{
+		saveError(L"%s:%d ResolveCharacteristicAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+	}
+	complete(target, completion);
+}
+CharacteristicHandle* ResolveCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId) {
+	Log(L"ResolveCharacteristic " + wstring(characteristicId));
+	const auto target = waitingTarget();
+	ResolveCharacteristicAsync(deviceId, serviceId, characteristicId, target);
+	Completion completion;
+	if (!waitForCompletion(target, &completion))
+		return nullptr;
+	return completion.handle;
+}
+
+GattWriteOption writeOption(uint32_t flags) {
+	return (flags & SEND_WITH_RESPONSE) ? GattWriteOption::WriteWithResponse : GattWriteOption::WriteWithoutResponse;
+}
+
+// no lookup, no string handling and no global lock, the handle already holds the characteristic
+bool SendDataByHandle(CharacteristicHandle* handle, const uint8_t* data, uint32_t size, uint32_t flags) {
+	if (handle == nullptr)
+		return false;
+	const auto characteristic = characteristicOf(handle);
+	if (!(flags & SEND_BLOCK)) {
+		WriteCharacteristicAsync(characteristic, makeBuffer(data, size), writeOption(flags), {});
+		return false;
+	}
+	const auto target = waitingTarget();
+	WriteCharacteristicAsync(characteristic, makeBuffer(data, size), writeOption(flags), target);
+	Completion completion;
+	return waitForCompletion(target, &completion) && completion.success;
+}
+
+void ReleaseCharacteristic(CharacteristicHandle* handle) {
+	if (handle == nullptr)
+		return;
+	{
+		lock_guard lock(handlesLock);
+		handles.remove(handle);
+	}
+	delete handle;
+}
+
+winrt::fire_and_forget ConnectAsync(wstring deviceId, OperationTarget target) {
+	auto completion = makeCompletion(OperationType::CONNECT);
+	try {
+		completion.success = (co_await retrieveDevice(deviceId.c_str())) != nullptr;
+	}
+	catch (winrt::hresult_error& ex)
+	{
+		saveError(L"%s:%d ConnectAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+	}
+	complete(target, completion);
+}
+
+winrt::fire_and_forget ReadAsync(GattCharacteristic characteristic, OperationTarget target) {
+	auto completion = makeCompletion(OperationType::READ);
+	try {
+		auto result = co_await characteristic.ReadValueAsync(BluetoothCacheMode::Uncached);
+		completion.status = (int32_t)result.Status();
+		if (result.Status() != GattCommunicationStatus::Success)
+			saveError(L"%s:%d Error reading characteristic with uuid %s", __WFILE__, __LINE__, to_hstring(characteristic.Uuid()).c_str());
+		else {
+			auto value = result.Value();
+			completion.size = (uint16_t)min<uint32_t>(value.Length(), sizeof(completion.buf));
+			memcpy(completion.buf, value.data(), completion.size);
+			completion.success = true;
+		}
+	}
+	catch (winrt::hresult_error& ex)
+	{
+		saveError(L"%s:%d ReadAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+	}
+	complete(target, completion);
+}
 
-	return result;
+uint64_t BeginConnect(wchar_t* deviceId) {
+	auto target = queuedTarget();
+	ConnectAsync(deviceId, target);
+	return target.id;
+}
+
+uint64_t BeginDiscover(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId) {
+	auto target = queuedTarget();
+	ResolveCharacteristicAsync(deviceId, serviceId, characteristicId, target);
+	return target.id;
+}
+
+uint64_t BeginSubscribe(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId) {
+	auto target = queuedTarget();
+	SubscribeCharacteristicAsync(deviceId, serviceId, characteristicId, target);
+	return target.id;
+}
+
+uint64_t BeginRead(CharacteristicHandle* handle) {
+	if (handle == nullptr)
+		return 0;
+	auto target = queuedTarget();
+	ReadAsync(characteristicOf(handle), target);
+	return target.id;
+}
+
+uint64_t BeginWrite(CharacteristicHandle* handle, const uint8_t* data, uint32_t size, uint32_t flags) {
+	if (handle == nullptr)
+		return 0;
+	auto target = queuedTarget();
+	WriteCharacteristicAsync(characteristicOf(handle), makeBuffer(data, size), writeOption(flags), target);
+	return target.id;
+}
+
+uint32_t PollCompletions(Completion* completions, uint32_t max, bool block) {
+	return (uint32_t)completionQueue.popBatch(completions, max, block, quitFlag);
+}
+
+// Scheduled reads for characteristics that can't notify. One scheduler thread for all devices issues the reads,
+// completions are delivered like notifications. Notifications never wait for the scheduler: Characteristic_ValueChanged
+// doesn't touch readSchedulerLock. And they go first on the link, a due read is deferred while its device is notifying
+// or PollData has a backlog, though never by more than its interval.
+const chrono::milliseconds NOTIFICATION_QUIET{ 20 };
+const size_t DATA_BACKLOG = 64;
+const uint32_t MIN_READ_INTERVAL_MS = 10;
+
+struct ScheduledRead {
+	GattCharacteristic characteristic = nullptr;
+	// ids of the handle, the read is matched by them like the handle and the subscriptions
+	wstring deviceId;
+	wstring serviceId;
+	wstring characteristicId;
+	// as reported by winrt, the records look like the ones of notifications
+	wstring recordDeviceId;
+	wstring serviceUuid;
+	wstring characteristicUuid;
+	long device;
+	shared_ptr<atomic<int64_t>> lastNotification;
+	chrono::milliseconds interval;
+	// nominal time of the next read and the time including jitter
+	chrono::steady_clock::time_point next;
+	chrono::steady_clock::time_point due;
+	bool pending = false;
+};
+mutex readSchedulerLock;
+condition_variable readSchedulerSignal;
+list<shared_ptr<ScheduledRead>> scheduledReads;
+map<long, uint32_t> readsInFlight;
+uint32_t maxReadsPerDevice = 1;
+chrono::milliseconds readJitter{ 10 };
+atomic<bool> readSchedulerStop = false;
+
+// Quit joins the scheduler. Like the dispatcher it is only told to stop if the host exits without Quit.
+struct ReadSchedulerThread {
+	thread worker;
+	~ReadSchedulerThread() {
+		readSchedulerStop = true;
+		readSchedulerSignal.notify_one();
+		if (worker.joinable())
+			worker.detach();
+	}
+};
+ReadSchedulerThread readScheduler;
+
+winrt::fire_and_forget ReadCharacteristicAsync(shared_ptr<ScheduledRead> read, GattCharacteristic characteristic) {
+	try {
+		GattReadResult result = co_await characteristic.ReadValueAsync(BluetoothCacheMode::Uncached);
+		if (result.Status() != GattCommunicationStatus::Success)
+			saveError(L"%s:%d Error reading characteristic with uuid %s and status %d", __WFILE__, __LINE__, read->characteristicUuid.c_str(), result.Status());
+		else if (!quitFlag) {
+			BLEData data;
+			const auto value = result.Value();
+			fill_data(data, read->recordDeviceId.c_str(), read->serviceUuid.c_str(), read->characteristicUuid.c_str(), value.data(), value.Length());
+			deliverData(data);
+		}
+	}
+	catch (winrt::hresult_error& ex)
+	{
+		saveError(L"%s:%d ReadCharacteristicAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+	}
+	{
+		lock_guard lock(readSchedulerLock);
+		read->pending = false;
+		auto inFlight = readsInFlight.find(read->device);
+		if (inFlight != readsInFlight.end() && inFlight->second > 0)
+			inFlight->second--;
+	}
+	readSchedulerSignal.notify_one();
+}
+
+void ReadSchedulerLoop() {
+	winrt::init_apartment(winrt::apartment_type::multi_threaded);
+	minstd_rand random(random_device{}());
+	vector<pair<shared_ptr<ScheduledRead>, GattCharacteristic>> due;
+	unique_lock<mutex> lock(readSchedulerLock);
+	while (!readSchedulerStop) {
+		const auto now = chrono::steady_clock::now();
+		auto wakeup = now + chrono::seconds(1);
+		const bool backlog = !broadcast.enabled() && dataQueue.size() > DATA_BACKLOG;
+		for (auto& read : scheduledReads) {
+			if (read->pending)
+				continue;
+			if (read->due > now) {
+				wakeup = min(wakeup, read->due);
+				continue;
+			}
+			const auto lastNotification = chrono::steady_clock::time_point(chrono::steady_clock::duration(read->lastNotification->load(memory_order_relaxed)));
+			if (now - read->due < read->interval && (backlog || now - lastNotification < NOTIFICATION_QUIET)) {
+				wakeup = min(wakeup, now + NOTIFICATION_QUIET);
+				continue;
+			}
+			// over the limit the read stays due, the completion of another read of this device wakes us up again
+			auto& inFlight = readsInFlight[read->device];
+			if (inFlight >= maxReadsPerDevice)
+				continue;
+			inFlight++;
+			read->pending = true;
+			read->next = max(read->next + read->interval, now);
+			read->due = read->next + chrono::milliseconds(uniform_int_distribution<long long>(0, readJitter.count())(random));
+			due.emplace_back(read, read->characteristic);
+		}
+		if (!due.empty()) {
+			// issue the reads without the lock, the coroutines take it when they complete
+			lock.unlock();
+			for (auto& [read, characteristic] : due)
+				ReadCharacteristicAsync(read, characteristic);
+			due.clear();
+			lock.lock();
+			continue;
+		}
+		readSchedulerSignal.wait_until(lock, wakeup);
+	}
+}
+
+// by ids, any handle of the characteristic reaches the read, also one resolved after the read's handle was released
+bool isReadOf(const ScheduledRead& read, CharacteristicHandle* handle) {
+	return read.device == hsh(handle->deviceId.c_str()) && make_guid(read.serviceId.c_str()) == make_guid(handle->serviceId.c_str())
+		&& make_guid(read.characteristicId.c_str()) == make_guid(handle->characteristicId.c_str());
+}
+
+bool ScheduleRead(CharacteristicHandle* handle, uint32_t intervalMs) {
+	if (handle == nullptr)
+		return false;
+	if (intervalMs < MIN_READ_INTERVAL_MS) {
+		saveError(L"%s:%d ScheduleRead: interval must be at least %u ms", __WFILE__, __LINE__, MIN_READ_INTERVAL_MS);
+		return false;
+	}
+	auto read = make_shared<ScheduledRead>();
+	read->deviceId = handle->deviceId;
+	read->serviceId = handle->serviceId;
+	read->characteristicId = handle->characteristicId;
+	try {
+		read->characteristic = characteristicOf(handle);
+		const auto service = read->characteristic.Service();
+		read->recordDeviceId = service.Device().DeviceId().c_str();
+		read->serviceUuid = to_hstring(service.Uuid()).c_str();
+		read->characteristicUuid = to_hstring(read->characteristic.Uuid()).c_str();
+	}
+	catch (winrt::hresult_error& ex)
+	{
+		saveError(L"%s:%d ScheduleRead catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+		return false;
+	}
+	Log(L"ScheduleRead " + read->characteristicUuid);
+	read->device = hsh(handle->deviceId.c_str());
+	read->lastNotification = activityOf(read->device);
+	read->interval = chrono::milliseconds(intervalMs);
+	read->next = read->due = chrono::steady_clock::now();
+	{
+		lock_guard lock(readSchedulerLock);
+		auto existing = find_if(scheduledReads.begin(), scheduledReads.end(), [&](const auto& r) { return isReadOf(*r, handle); });
+		if (existing != scheduledReads.end())
+			(*existing)->interval = read->interval;
+		else
+			scheduledReads.push_back(read);
+		readSchedulerStop = false;
+		if (!readScheduler.worker.joinable())
+			readScheduler.worker = thread(ReadSchedulerLoop);
+	}
+	readSchedulerSignal.notify_one();
+	return true;
+}
+
+void UnscheduleRead(CharacteristicHandle* handle) {
+	if (handle == nullptr)
+		return;
+	lock_guard lock(readSchedulerLock);
+	scheduledReads.remove_if([&](const auto& r) { return isReadOf(*r, handle); });
+}
+
+void SetReadSchedulerOptions(uint32_t maxReads, uint32_t jitterMs) {
+	{
+		lock_guard lock(readSchedulerLock);
+		maxReadsPerDevice = max(maxReads, 1u);
+		readJitter = chrono::milliseconds(jitterMs);
+	}
+	readSchedulerSignal.notify_one();
+}
+
+void StopReadScheduler() {
+	{
+		lock_guard lock(readSchedulerLock);
+		readSchedulerStop = true;
+		scheduledReads.clear();
+		readsInFlight.clear();
+	}
+	readSchedulerSignal.notify_one();
+	if (readScheduler.worker.joinable())
+		readScheduler.worker.join();
+}
+
+// Automatic reconnection. A device that was connected once is watched, when the connection is lost while it is in use
+// its cache entry is rebuilt with backoff until the subscriptions are restored. Handles and scheduled reads then get the
+// new characteristics. Quit and Disconnect end a recovery, Detach doesn't: a connection lost during a domain reload is
+// restored like any other.
+struct ReconnectOptions {
+	bool enabled = true;
+	chrono::milliseconds initialDelay{ 500 };
+	chrono::milliseconds maxDelay{ 10000 };
+	// 0 means no limit
+	uint32_t maxAttempts = 0;
+};
+struct ConnectionWatch {
+	// changes when the watch is removed and created again, e.g. by Disconnect and a later connect
+	uint64_t id = 0;
+	wstring deviceId;
+	// the watched connection, tells a recovery whether the watch belongs to the device it opened
+	BluetoothLEDevice device = nullptr;
+	BluetoothLEDevice::ConnectionStatusChanged_revoker revoker;
+	bool connected = false;
+	bool recovering = false;
+	chrono::steady_clock::time_point lostAt;
+};
+mutex reconnectLock;
+ReconnectOptions reconnectOptions;
+map<long, ConnectionWatch> connectionWatches;
+uint64_t nextWatchId = 0;
+ReconnectStats reconnectStats{};
+// counts Quit calls, so that a recovery notices a Quit even before the watches are cleared
+atomic<uint32_t> quitCount = 0;
+
+// removes the device from the cache so that the next retrieveDevice connects again
+// with expected, only a cache entry of that connection is closed
+void evictDevice(long device, BluetoothLEDevice const& expected = nullptr) {
+	DeviceCacheEntry entry;
+	{
+		lock_guard lock(cacheLock);
+		auto item = cache.find(device);
+		if (item == cache.end() || (expected != nullptr && item->second.device != expected))
+			return;
+		entry = move(item->second);
+		cache.erase(item);
+	}
+	try {
+		if (entry.device != nullptr)
+			entry.device.Close();
+		for (auto& service : entry.services)
+			service.second.service.Close();
+	}
+	catch (winrt::hresult_error& ex)
+	{
+		saveError(L"%s:%d evictDevice catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+	}
+}
+
+// 0 if the device is not watched
+uint64_t watchIdOf(long device) {
+	lock_guard lock(reconnectLock);
+	auto watch = connectionWatches.find(device);
+	return watch != connectionWatches.end() ? watch->second.id : 0;
+}
+
+// A device without subscriptions, handles or scheduled reads is not reconnected, e.g. one that was only browsed.
+// Windows drops its idle connection, a reconnect would only be dropped again.
+bool deviceInUse(long device) {
+	{
+		lock_guard lock(subscribeQueueLock);
+		if (any_of(subscriptions.begin(), subscriptions.end(), [&](const auto& s) { return hsh(s.deviceId.c_str()) == device; }))
+			return true;
+	}
+	{
+		lock_guard lock(handlesLock);
+		if (any_of(handles.begin(), handles.end(), [&](const auto& h) { return hsh(h->deviceId.c_str()) == device; }))
+			return true;
+	}
+	lock_guard lock(readSchedulerLock);
+	return any_of(scheduledReads.begin(), scheduledReads.end(), [&](const auto& r) { return r->device == device; });
+}
+
+// Gives handles and scheduled reads of the device the characteristics of the rebuilt cache entry. Both are matched by
+// their ids, a scheduled read outlives the handle it was created from.
+IAsyncAction rebindCharacteristicsAsync(wstring deviceId) {
+	const long device = hsh(deviceId.c_str());
+	struct Rebind {
+		wstring serviceId;
+		wstring characteristicId;
+		winrt::guid service;
+		winrt::guid characteristic;
+		GattCharacteristic result = nullptr;
+	};
+	vector<Rebind> rebinds;
+	auto add = [&](const wstring& serviceId, const wstring& characteristicId) {
+		const auto service = make_guid(serviceId.c_str());
+		const auto characteristic = make_guid(characteristicId.c_str());
+		if (none_of(rebinds.begin(), rebinds.end(), [&](const auto& r) { return r.service == service && r.characteristic == characteristic; }))
+			rebinds.push_back({ serviceId, characteristicId, service, characteristic });
+	};
+	auto find = [&](const wstring& serviceId, const wstring& characteristicId) -> GattCharacteristic {
+		const auto service = make_guid(serviceId.c_str());
+		const auto characteristic = make_guid(characteristicId.c_str());
+		for (auto& rebind : rebinds)
+			if (rebind.service == service && rebind.characteristic == characteristic)
+				return rebind.result;
+		return nullptr;
+	};
+	{
+		lock_guard lock(handlesLock);
+		for (auto handle : handles)
+			if (hsh(handle->deviceId.c_str()) == device)
+				add(handle->serviceId, handle->characteristicId);
+	}
+	{
+		lock_guard lock(readSchedulerLock);
+		for (auto& read : scheduledReads)
+			if (read->device == device)
+				add(read->serviceId, read->characteristicId);
+	}
+	for (auto& rebind : rebinds)
+		rebind.result = co_await retrieveCharacteristic(deviceId.c_str(), rebind.serviceId.c_str(), rebind.characteristicId.c_str());
+	// handles released and reads unscheduled in the meantime are not in the lists anymore
+	{
+		lock_guard lock(handlesLock);
+		for (auto handle : handles) {
+			if (hsh(handle->deviceId.c_str()) != device)
+				continue;
+			if (auto characteristic = find(handle->serviceId, handle->characteristicId)) {
+				lock_guard handleLock(handle->lock);
+				handle->characteristic = characteristic;
+			}
+		}
+	}
+	lock_guard lock(readSchedulerLock);
+	for (auto& read : scheduledReads)
+		if (read->device == device)
+			if (auto characteristic = find(read->serviceId, read->characteristicId))
+				read->characteristic = characteristic;
+}
+
+winrt::fire_and_forget RecoverDeviceAsync(wstring deviceId) {
+	const long device = hsh(deviceId.c_str());
+	const uint32_t session = quitCount;
+	ReconnectOptions options;
+	chrono::steady_clock::time_point lostAt;
+	uint64_t watchId;
+	{
+		lock_guard lock(reconnectLock);
+		auto watch = connectionWatches.find(device);
+		if (watch == connectionWatches.end())
+			co_return;
+		options = reconnectOptions;
+		lostAt = watch->second.lostAt;
+		watchId = watch->second.id;
+	}
+	// checked after every co_await, Quit or Disconnect may have run in the meantime
+	auto aborted = [&]() { return quitCount != session || watchIdOf(device) != watchId; };
+	// The lost subscriptions stay in the list with their handlers revoked, so that their analyzers stay reachable and a
+	// subscribe call takes them over instead of adding a second handler. Their ids are copied to restore them.
+	struct Lost {
+		wstring serviceId;
+		wstring characteristicId;
+		shared_ptr<StreamAnalyzer> analyzer;
+	};
+	vector<Lost> lost;
+	{
+		lock_guard lock(subscribeQueueLock);
+		for (auto& subscription : subscriptions) {
+			if (hsh(subscription.deviceId.c_str()) != device)
+				continue;
+			subscription.revoker.revoke();
+			subscription.recovering = true;
+			lost.push_back({ subscription.serviceId, subscription.characteristicId, subscription.analyzer });
+		}
+	}
+
+	bool recovered = false;
+	// the connection of the last attempt, an abort closes nothing else
+	BluetoothLEDevice opened = nullptr;
+	auto delay = options.initialDelay;
+	for (uint32_t attempt = 1; !aborted() && (options.maxAttempts == 0 || attempt <= options.maxAttempts); attempt++) {
+		co_await delay;
+		if (aborted())
+			break;
+		delay = min(delay * 2, options.maxDelay);
+		evictDevice(device);
+		opened = nullptr;
+		vector<pair<GattCharacteristic, GattCharacteristic::ValueChanged_revoker>> restored;
+		try {
+			// the cache entry was just evicted, so the device is connected anew and the characteristics below use it
+			opened = co_await retrieveDevice(deviceId.c_str());
+			recovered = opened != nullptr && !aborted();
+			if (recovered && lost.empty()) {
+				// nothing to subscribe, but the device must answer
+				recovered = (co_await opened.GetGattServicesAsync(BluetoothCacheMode::Uncached)).Status() == GattCommunicationStatus::Success && !aborted();
+			}
+			for (auto& subscription : lost) {
+				if (!recovered)
+					break;
+				auto characteristic = co_await retrieveCharacteristic(deviceId.c_str(), subscription.serviceId.c_str(), subscription.characteristicId.c_str());
+				if (characteristic == nullptr || aborted()) {
+					recovered = false;
+					break;
+				}
+				auto status = co_await characteristic.WriteClientCharacteristicConfigurationDescriptorAsync(GattClientCharacteristicConfigurationDescriptorValue::Notify);
+				if (status != GattCommunicationStatus::Success || aborted()) {
+					recovered = false;
+					break;
+				}
+				restored.emplace_back(characteristic, registerValueChanged(characteristic, deviceId, subscription.analyzer));
+			}
+			if (recovered)
+				co_await rebindCharacteristicsAsync(deviceId);
+		}
+		catch (winrt::hresult_error& ex)
+		{
+			saveError(L"%s:%d RecoverDeviceAsync catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+			recovered = false;
+		}
+		if (recovered) {
+			lock_guard lock(subscribeQueueLock);
+			// Quit clears the subscriptions after counting itself, checking under the lock keeps them cleared
+			if (!aborted()) {
+				for (size_t i = 0; i < lost.size(); i++) {
+					auto subscription = findSubscription(deviceId.c_str(), lost[i].serviceId.c_str(), lost[i].characteristicId.c_str());
+					// one taken over by a subscribe in the meantime keeps its own handler
+					if (subscription == subscriptions.end() || !subscription->recovering)
+						continue;
+					subscription->characteristic = restored[i].first;
+					subscription->revoker = move(restored[i].second);
+					subscription->recovering = false;
+				}
+				break;
+			}
+			recovered = false;
+		}
+		// the handlers left in restored are revoked when it goes out of scope
+		if (aborted())
+			break;
+		Log(L"Reconnect attempt " + to_wstring(attempt) + L" to " + deviceId + L" failed");
+		lock_guard lock(reconnectLock);
+		reconnectStats.failedAttempts++;
+	}
+
+	if (!recovered) {
+		// nobody restores them anymore
+		lock_guard lock(subscribeQueueLock);
+		subscriptions.remove_if([&](const auto& s) { return s.recovering && hsh(s.deviceId.c_str()) == device; });
+	}
+	if (!recovered && aborted()) {
+		// The connection and watch opened by the attempt must not survive the Quit or Disconnect. After a Disconnect the
+		// user may have connected again already, that connection and its watch are left alone.
+		if (opened != nullptr) {
+			evictDevice(device, opened);
+			lock_guard lock(reconnectLock);
+			auto watch = connectionWatches.find(device);
+			if (watch != connectionWatches.end() && watch->second.device == opened)
+				connectionWatches.erase(watch);
+		}
+		Log(L"Reconnecting to " + deviceId + L" stopped");
+		co_return;
+	}
+	const auto recoveryMs = (uint32_t)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - lostAt).count();
+	{
+		lock_guard lock(reconnectLock);
+		auto watch = connectionWatches.find(device);
+		if (watch != connectionWatches.end())
+			watch->second.recovering = false;
+		if (recovered) {
+			reconnectStats.reconnects++;
+			reconnectStats.lastRecoveryMs = recoveryMs;
+			reconnectStats.maxRecoveryMs = max(reconnectStats.maxRecoveryMs, recoveryMs);
+			reconnectStats.totalRecoveryMs += recoveryMs;
+		}
+	}
+	if (recovered)
+		Log(L"Reconnected to " + deviceId + L" after " + to_wstring(recoveryMs) + L" ms");
+	else
+		saveError(L"%s:%d Reconnecting to %s failed, its subscriptions are dropped", __WFILE__, __LINE__, deviceId.c_str());
+}
+
+void Device_ConnectionStatusChanged(BluetoothLEDevice const& bluetoothLeDevice, IInspectable const&) {
+	const bool connected = bluetoothLeDevice.ConnectionStatus() == BluetoothConnectionStatus::Connected;
+	const long device = hsh(bluetoothLeDevice.DeviceId().c_str());
+	// taken before reconnectLock, which is never held while taking the other locks
+	const bool inUse = connected || deviceInUse(device);
+	wstring deviceId;
+	{
+		lock_guard lock(reconnectLock);
+		auto watch = connectionWatches.find(device);
+		if (watch == connectionWatches.end())
+			return;
+		const bool lost = watch->second.connected && !connected;
+		watch->second.connected = connected;
+		if (!lost || watch->second.recovering || !reconnectOptions.enabled)
+			return;
+		deviceId = watch->second.deviceId;
+		if (!inUse)
+			connectionWatches.erase(watch);
+		else {
+			watch->second.recovering = true;
+			watch->second.lostAt = chrono::steady_clock::now();
+			reconnectStats.disconnects++;
+		}
+	}
+	if (!inUse) {
+		// the next retrieveDevice connects and watches it again
+		Log(L"Idle connection to " + deviceId + L" closed");
+		evictDevice(device);
+		return;
+	}
+	Log(L"Connection lost to " + deviceId);
+	RecoverDeviceAsync(deviceId);
+}
+
+void watchConnection(const wchar_t* deviceId, BluetoothLEDevice const& device) {
+	lock_guard lock(reconnectLock);
+	auto& watch = connectionWatches[hsh(deviceId)];
+	if (watch.id == 0)
+		watch.id = ++nextWatchId;
+	watch.deviceId = deviceId;
+	watch.device = device;
+	watch.connected = device.ConnectionStatus() == BluetoothConnectionStatus::Connected;
+	watch.revoker = device.ConnectionStatusChanged(winrt::auto_revoke, &Device_ConnectionStatusChanged);
+}
+
+void SetReconnectOptions(bool enabled, uint32_t initialDelayMs, uint32_t maxDelayMs, uint32_t maxAttempts) {
+	lock_guard lock(reconnectLock);
+	reconnectOptions.enabled = enabled;
+	reconnectOptions.initialDelay = chrono::milliseconds(initialDelayMs);
+	reconnectOptions.maxDelay = chrono::milliseconds(max(maxDelayMs, initialDelayMs));
+	reconnectOptions.maxAttempts = maxAttempts;
+}
+
+void GetReconnectStats(ReconnectStats* stats) {
+	lock_guard lock(reconnectLock);
+	*stats = reconnectStats;
 }
 
 void Disconnect(wchar_t* deviceId)
@@ -633,6 +1561,10 @@ void Disconnect(wchar_t* deviceId)
 		msg += deviceId;
 		Log(msg);
 		const auto hash = hsh(deviceId);
+		{
+			lock_guard lock(reconnectLock);
+			connectionWatches.erase(hash);
+		}
 		{
 			lock_guard lock(cacheLock);
 			const auto devP = cache.find(hash);
@@ -659,8 +1591,8 @@ void Disconnect(wchar_t* deviceId)
 	}
 }
 
-void Quit() {
-	quitFlag = true;
+// wakes up blocked calls and drops everything that was not polled yet
+void releasePollers() {
 	StopDeviceScan();
 	deviceQueueSignal.notify_one();
 	{
@@ -677,29 +1609,122 @@ void Quit() {
 		lock_guard lock(characteristicQueueLock);
 		characteristicQueue = {};
 	}
-	subscribeQueueSignal.notify_one();
+	{
+		// notifying under the lock of each waiter makes sure that one that has just checked quit is already waiting
+		lock_guard lock(waitersLock);
+		for (auto& waiter : waiters) {
+			lock_guard waiterLock(waiter->lock);
+			waiter->signal.notify_all();
+		}
+	}
+	// discoveries that were not polled own their handles
+	queue<Completion> dropped;
+	{
+		lock_guard lock(completionQueue.lock);
+		completionSession++;
+		dropped.swap(completionQueue.items);
+	}
+	completionQueue.wake();
+	for (; !dropped.empty(); dropped.pop())
+		discardCompletion(dropped.front());
+	dataQueue.wake();
+	dataQueue.clear();
+	broadcast.wake();
+}
+
+// Closes every device on its own thread so that one slow Close doesn't hold up the others. Returns false if they didn't
+// finish within the timeout, the remaining ones keep closing in the background.
+bool closeConnections(map<long, DeviceCacheEntry> devices, chrono::milliseconds timeout) {
+	struct Pending {
+		mutex lock;
+		condition_variable signal;
+		size_t remaining;
+	};
+	auto pending = make_shared<Pending>();
+	pending->remaining = devices.size();
+	for (auto& device : devices) {
+		thread([entry = move(device.second), pending]() {
+			winrt::init_apartment(winrt::apartment_type::multi_threaded);
+			try {
+				if (entry.device != nullptr)
+					entry.device.Close();
+				for (auto& service : entry.services)
+					service.second.service.Close();
+			}
+			catch (winrt::hresult_error& ex)
+			{
+				saveError(L"%s:%d closeConnections catch: %s", __WFILE__, __LINE__, ex.message().c_str());
+			}
+			{
+				lock_guard lock(pending->lock);
+				pending->remaining--;
+			}
+			pending->signal.notify_one();
+		}).detach();
+	}
+	unique_lock<mutex> lock(pending->lock);
+	return pending->signal.wait_for(lock, timeout, [&] { return pending->remaining == 0; });
+}
+
+bool QuitWithTimeout(uint32_t timeoutMs) {
+	const auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	quitFlag = true;
+	quitCount++;
+	releasePollers();
 	{
 		lock_guard lock(subscribeQueueLock);
 		for (auto& subscription : subscriptions)
 			subscription.revoker.revoke();
 		subscriptions.clear();
 	}
-	dataQueueSignal.notify_one();
+	StopReadScheduler();
+	StopDispatcher();
 	{
-		lock_guard lock(dataQueueLock);
-		dataQueue = {};
+		lock_guard lock(reconnectLock);
+		connectionWatches.clear();
 	}
+	map<long, DeviceCacheEntry> devices;
 	{
 		lock_guard lock(cacheLock);
-		/* Copy as per original source. Dunno why. */
-		for (auto device : cache) {
-			device.second.device.Close();
-			for (auto service : device.second.services) {
-				service.second.service.Close();
-			}
-		}
-		cache.clear();
+		devices.swap(cache);
+	}
+	// stopping the threads above already took part of the time
+	const auto remaining = max(chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()), chrono::milliseconds(0));
+	const bool closed = closeConnections(move(devices), remaining);
+	if (!closed)
+		Log("QuitWithTimeout: not all devices closed in time");
+	return closed;
+}
+
+void Quit() {
+	QuitWithTimeout(INFINITE);
+}
+
+void Detach() {
+	Log("Detach");
+	// drops notifications until Reattach and releases the threads of the unloading domain
+	quitFlag = true;
+	releasePollers();
+	broadcast.removeConsumers();
+	// nobody is left to release the handles of the unloading domain, and they would keep their devices in use
+	list<CharacteristicHandle*> released;
+	{
+		lock_guard lock(handlesLock);
+		released.swap(handles);
 	}
+	for (auto handle : released)
+		delete handle;
+	// the callback is a delegate of the unloading domain
+	logger = nullptr;
+	while (loggerCalls > 0)
+		this_thread::yield();
+}
+
+void Reattach() {
+	dataQueue.clear();
+	quitFlag = false;
+	clearError();
+	Log("Reattach");
 }
 
 void GetError(ErrorMessage* buf) {
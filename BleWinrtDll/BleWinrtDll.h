@@ -2,36 +2,7 @@
 
 #include "stdafx.h"
 
-struct DeviceUpdate {
-	wchar_t id[256];
-	bool isConnectable = false;
-	wchar_t name[256];
-	uint8_t advData[32];
-	uint32_t advDataLen;
-};
-
-struct Service {
-	wchar_t uuid[100];
-};
-
-struct Characteristic {
-	wchar_t uuid[100];
-	wchar_t userDescription[100];
-};
-
-struct BLEData {
-	uint8_t buf[512];
-	uint16_t size;
-	wchar_t deviceId[256];
-	wchar_t serviceUuid[256];
-	wchar_t characteristicUuid[256];
-};
-
-struct ErrorMessage {
-	wchar_t msg[1024];
-};
-
-enum class ScanStatus { PROCESSING, AVAILABLE, FINISHED };
+#include "BleTypes.h"
 
 extern "C" {
 
@@ -52,14 +23,108 @@ extern "C" {
 	/* Return value only makes sense if block=true */
 	__declspec(dllexport) bool SubscribeCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, bool block);
 
+	/* Starts counting gaps, duplicates and reordered frames of a subscribed characteristic. The sequence number is the
+	   little endian field of width (1-4, 0 for none) bytes at offset, counting modulo wrap (0 for the full field).
+	   Inter-arrival times are sorted into a histogram relative to expectedIntervalUs. Resets the counters. Fails if the
+	   field doesn't fit into a payload of BLEData, is wider than 4 bytes or wrap is 1 or exceeds the range of the field. */
+	__declspec(dllexport) bool ConfigureStreamAnalyzer(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, uint32_t offset, uint32_t width, uint32_t wrap, uint32_t expectedIntervalUs);
+
+	__declspec(dllexport) bool GetStreamStats(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId, StreamStats* stats);
+
 	__declspec(dllexport) bool PollData(BLEData* data, bool block);
 
+	/* Moves record building and queueing of notifications from the WinRT threadpool to a thread of the dll with the given
+	   priority (THREAD_PRIORITY_*) and, unless 0, affinity mask. Returns false if it is already running. */
+	__declspec(dllexport) bool StartDispatcher(int32_t priority, uint64_t affinityMask);
+
+	/* Notifications that were not dispatched yet are dropped */
+	__declspec(dllexport) void StopDispatcher();
+
 	__declspec(dllexport) bool SendData(BLEData* data, bool block);
 
+	/* Broadcast mode: notifications are written once into a ring of the given capacity that every registered consumer reads
+	   with its own cursor, instead of into the single queue of PollData. A consumer that falls behind by more than the
+	   capacity skips the oldest items and counts them as overruns. Enable before subscribing, 0 switches back to PollData.
+	   Fails while consumers are registered, e.g. those of a previous domain that didn't call Detach. */
+	__declspec(dllexport) bool EnableBroadcast(uint32_t capacity);
+
+	/* Returns -1 if no consumer slot is left */
+	__declspec(dllexport) int32_t RegisterConsumer();
+
+	__declspec(dllexport) void UnregisterConsumer(int32_t consumer);
+
+	/* Must not be called concurrently for the same consumer */
+	__declspec(dllexport) bool PollBroadcast(int32_t consumer, BLEData* data, bool block);
+
+	__declspec(dllexport) void GetConsumerStats(int32_t consumer, ConsumerStats* stats);
+
+	/* Resolves the characteristic once so that SendDataByHandle can skip the lookup. Blocks, returns nullptr on failure.
+	   The handle stays valid until ReleaseCharacteristic, but writes fail after the device is disconnected. */
+	__declspec(dllexport) CharacteristicHandle* ResolveCharacteristic(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId);
+
+	/* flags is a combination of SendFlags. Return value only makes sense with SEND_BLOCK */
+	__declspec(dllexport) bool SendDataByHandle(CharacteristicHandle* handle, const uint8_t* data, uint32_t size, uint32_t flags);
+
+	__declspec(dllexport) void ReleaseCharacteristic(CharacteristicHandle* handle);
+
+	/* Start an operation without blocking and return its id, the result is posted to the completion queue. Any number of
+	   operations can be in flight. BeginDiscover resolves a handle like ResolveCharacteristic. BeginRead and BeginWrite
+	   return 0 for a null handle, in that case nothing is posted. Quit and Detach drop completions that were not polled
+	   and those of operations still running, handles of dropped DISCOVER completions are released. */
+	__declspec(dllexport) uint64_t BeginConnect(wchar_t* deviceId);
+
+	__declspec(dllexport) uint64_t BeginDiscover(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId);
+
+	__declspec(dllexport) uint64_t BeginSubscribe(wchar_t* deviceId, wchar_t* serviceId, wchar_t* characteristicId);
+
+	__declspec(dllexport) uint64_t BeginRead(CharacteristicHandle* handle);
+
+	/* flags is a combination of SendFlags, SEND_BLOCK is ignored */
+	__declspec(dllexport) uint64_t BeginWrite(CharacteristicHandle* handle, const uint8_t* data, uint32_t size, uint32_t flags);
+
+	/* Copies up to max completions in the order they finished and returns their number. With block, waits until at least
+	   one is available, 0 means Quit was called. */
+	__declspec(dllexport) uint32_t PollCompletions(Completion* completions, uint32_t max, bool block);
+
+	/* Reads the characteristic every intervalMs (at least 10) on a scheduler thread of the dll. Results are delivered via
+	   PollData like notifications. Scheduling the same characteristic again updates its interval. Notifications have
+	   priority: a read is deferred by up to one interval while its device is notifying or PollData falls behind. */
+	__declspec(dllexport) bool ScheduleRead(CharacteristicHandle* handle, uint32_t intervalMs);
+
+	/* Works with any handle of the characteristic, the read outlives the handle it was scheduled with. */
+	__declspec(dllexport) void UnscheduleRead(CharacteristicHandle* handle);
+
+	/* Limits concurrent scheduled reads per device (default 1) and delays each read by a random 0..jitterMs (default 10) */
+	__declspec(dllexport) void SetReadSchedulerOptions(uint32_t maxReadsPerDevice, uint32_t jitterMs);
+
+	/* Connections that are lost are rebuilt automatically with exponential backoff from initialDelayMs to maxDelayMs, and the
+	   subscriptions, handles and scheduled reads of the device are restored. maxAttempts 0 means no limit.
+	   Enabled by default with 500 ms, 10000 ms and no limit. Devices without any of them are not reconnected, their
+	   connection is dropped until the next use. Quit and Disconnect stop a reconnect, Detach doesn't. While reconnecting,
+	   the subscriptions keep their stream analyzers and subscribing again restores one right away. */
+	__declspec(dllexport) void SetReconnectOptions(bool enabled, uint32_t initialDelayMs, uint32_t maxDelayMs, uint32_t maxAttempts);
+
+	__declspec(dllexport) void GetReconnectStats(ReconnectStats* stats);
+
 	__declspec(dllexport) void Disconnect(wchar_t* deviceId);
 
 	__declspec(dllexport) void Quit();
 
+	/* Like Quit, but closes the devices in parallel and gives up waiting for them when timeoutMs have passed since the
+	   call. Returns false if some devices were still closing, they are closed in the background. Revoking the
+	   subscriptions and stopping the dispatcher and read scheduler threads come first and count against the timeout,
+	   but are not cut short by it. */
+	__declspec(dllexport) bool QuitWithTimeout(uint32_t timeoutMs);
+
+	/* Call instead of Quit before a domain reload. Connections and subscriptions stay alive, blocked calls return,
+	   notifications are dropped and the log callback is unregistered until Reattach, log calls in flight have returned
+	   when Detach returns. Subscribing again to a kept characteristic succeeds immediately. All handles are released and
+	   must not be used anymore, resolve them again after Reattach. Scheduled reads keep running, any new handle of their
+	   characteristic unschedules them. */
+	__declspec(dllexport) void Detach();
+
+	__declspec(dllexport) void Reattach();
+
 	__declspec(dllexport) void GetError(ErrorMessage* buf);
 
 	using DebugLogCallback = void(const char*);
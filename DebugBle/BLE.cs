@@ -84,12 +84,144 @@ public class BLE
         [DllImport("BleWinrtDll.dll", EntryPoint = "SendData")]
         public static extern bool SendData(in BLEData data, bool block);
 
+        [DllImport("BleWinrtDll.dll", EntryPoint = "ConfigureStreamAnalyzer", CharSet = CharSet.Unicode)]
+        public static extern bool ConfigureStreamAnalyzer(string deviceId, string serviceId, string characteristicId, uint offset, uint width, uint wrap, uint expectedIntervalUs);
+
+        [StructLayout(LayoutKind.Sequential)]
+        public struct StreamStats
+        {
+            public ulong received;
+            public ulong lost;
+            public ulong gaps;
+            public ulong duplicates;
+            public ulong reordered;
+            public ulong discontinuities;
+            public ulong malformed;
+            public uint meanIntervalUs;
+            public uint maxIntervalUs;
+            [MarshalAs(UnmanagedType.ByValArray, SizeConst = 8)]
+            public ulong[] intervalHistogram;
+        };
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "GetStreamStats", CharSet = CharSet.Unicode)]
+        public static extern bool GetStreamStats(string deviceId, string serviceId, string characteristicId, out StreamStats stats);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "StartDispatcher")]
+        public static extern bool StartDispatcher(int priority, ulong affinityMask);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "StopDispatcher")]
+        public static extern void StopDispatcher();
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "EnableBroadcast")]
+        public static extern bool EnableBroadcast(uint capacity);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "RegisterConsumer")]
+        public static extern int RegisterConsumer();
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "UnregisterConsumer")]
+        public static extern void UnregisterConsumer(int consumer);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "PollBroadcast")]
+        public static extern bool PollBroadcast(int consumer, out BLEData data, bool block);
+
+        [StructLayout(LayoutKind.Sequential)]
+        public struct ConsumerStats
+        {
+            public ulong lag;
+            public ulong overruns;
+        };
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "GetConsumerStats")]
+        public static extern void GetConsumerStats(int consumer, out ConsumerStats stats);
+
+        [Flags]
+        public enum SendFlags : uint { BLOCK = 1, WITH_RESPONSE = 2 };
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "ResolveCharacteristic", CharSet = CharSet.Unicode)]
+        public static extern IntPtr ResolveCharacteristic(string deviceId, string serviceId, string characteristicId);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "SendDataByHandle")]
+        public static extern bool SendDataByHandle(IntPtr handle, byte[] data, uint size, SendFlags flags);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "ReleaseCharacteristic")]
+        public static extern void ReleaseCharacteristic(IntPtr handle);
+
+        public enum OperationType : uint { CONNECT, DISCOVER, SUBSCRIBE, READ, WRITE };
+
+        [StructLayout(LayoutKind.Sequential)]
+        public struct Completion
+        {
+            public ulong id;
+            public OperationType type;
+            [MarshalAs(UnmanagedType.U1)]
+            public bool success;
+            public int status;
+            public IntPtr handle;
+            [MarshalAs(UnmanagedType.ByValArray, SizeConst = 512)]
+            public byte[] buf;
+            [MarshalAs(UnmanagedType.I2)]
+            public short size;
+        };
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "BeginConnect", CharSet = CharSet.Unicode)]
+        public static extern ulong BeginConnect(string deviceId);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "BeginDiscover", CharSet = CharSet.Unicode)]
+        public static extern ulong BeginDiscover(string deviceId, string serviceId, string characteristicId);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "BeginSubscribe", CharSet = CharSet.Unicode)]
+        public static extern ulong BeginSubscribe(string deviceId, string serviceId, string characteristicId);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "BeginRead")]
+        public static extern ulong BeginRead(IntPtr handle);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "BeginWrite")]
+        public static extern ulong BeginWrite(IntPtr handle, byte[] data, uint size, SendFlags flags);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "PollCompletions")]
+        public static extern uint PollCompletions([Out] Completion[] completions, uint max, bool block);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "ScheduleRead")]
+        public static extern bool ScheduleRead(IntPtr handle, uint intervalMs);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "UnscheduleRead")]
+        public static extern void UnscheduleRead(IntPtr handle);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "SetReadSchedulerOptions")]
+        public static extern void SetReadSchedulerOptions(uint maxReadsPerDevice, uint jitterMs);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "SetReconnectOptions")]
+        public static extern void SetReconnectOptions(bool enabled, uint initialDelayMs, uint maxDelayMs, uint maxAttempts);
+
+        [StructLayout(LayoutKind.Sequential)]
+        public struct ReconnectStats
+        {
+            public uint disconnects;
+            public uint reconnects;
+            public uint failedAttempts;
+            public uint lastRecoveryMs;
+            public uint maxRecoveryMs;
+            public ulong totalRecoveryMs;
+        };
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "GetReconnectStats")]
+        public static extern void GetReconnectStats(out ReconnectStats stats);
+
         [DllImport("BleWinrtDll.dll", EntryPoint = "Disconnect", CharSet = CharSet.Unicode)]
         public static extern void Disconnect(string deviceId);
 
         [DllImport("BleWinrtDll.dll", EntryPoint = "Quit")]
         public static extern void Quit();
 
+        [DllImport("BleWinrtDll.dll", EntryPoint = "QuitWithTimeout")]
+        public static extern bool QuitWithTimeout(uint timeoutMs);
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "Detach")]
+        public static extern void Detach();
+
+        [DllImport("BleWinrtDll.dll", EntryPoint = "Reattach")]
+        public static extern void Reattach();
+
         [StructLayout(LayoutKind.Sequential, CharSet = CharSet.Unicode)]
         public struct ErrorMessage
         {
@@ -214,6 +346,33 @@ public class BLE
         return Impl.SendData(in packageSend, true);
     }
 
+    // resolve once to avoid the characteristic lookup on every write, returns IntPtr.Zero on failure
+    public static IntPtr ResolveCharacteristic(string deviceId, string serviceUuid, string characteristicUuid)
+    {
+        return Impl.ResolveCharacteristic(deviceId, serviceUuid, characteristicUuid);
+    }
+
+    public static void ReleaseCharacteristic(IntPtr characteristic)
+    {
+        Impl.ReleaseCharacteristic(characteristic);
+    }
+
+    public static bool WritePackage(IntPtr characteristic, byte[] data)
+    {
+        return Impl.SendDataByHandle(characteristic, data, (uint)data.Length, Impl.SendFlags.BLOCK);
+    }
+
+    // periodically reads a characteristic that can't notify, the values arrive via ReadPackage like notifications
+    public static bool ScheduleRead(IntPtr characteristic, uint intervalMs)
+    {
+        return Impl.ScheduleRead(characteristic, intervalMs);
+    }
+
+    public static void UnscheduleRead(IntPtr characteristic)
+    {
+        Impl.UnscheduleRead(characteristic);
+    }
+
     public static void ReadPackage()
     {
         Impl.BLEData packageReceived;
@@ -234,6 +393,17 @@ public class BLE
         isConnected = false;
     }
 
+    // keeps connections and subscriptions in the dll across a domain reload, call Reattach in the next domain
+    public static void Detach()
+    {
+        Impl.Detach();
+    }
+
+    public static void Reattach()
+    {
+        Impl.Reattach();
+    }
+
     public static string GetError()
     {
         Impl.ErrorMessage buf;
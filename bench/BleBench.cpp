@@ -0,0 +1,346 @@
+// BleBench.cpp : Benchmarks for the hot paths of the dll that don't need the winrt runtime.
+//
+// Build and run on any platform with google benchmark installed:
+//   cmake -S bench -B bench/build && cmake --build bench/build
+//   bench/build/BleBench --benchmark_out=bench.json --benchmark_out_format=json
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "BleCore.h"
+
+using namespace std;
+
+// typical values as seen with the glove
+const wchar_t* DEVICE_ID = L"BluetoothLE#BluetoothLEe0:d4:e8:1c:2b:7a-c1:2b:44:56:9f:3d";
+const wchar_t* SERVICE_UUID = L"{f6f04ffa-9a61-11e9-a2a3-2a2ae2dbcce4}";
+const wchar_t* CHARACTERISTIC_UUID = L"{f6f07c3c-9a61-11e9-a2a3-2a2ae2dbcce4}";
+
+// 20 bytes is the payload of the default ATT_MTU, 244 the maximum with data length extension
+#define PAYLOAD_SIZES ->Arg(20)->Arg(64)->Arg(128)->Arg(244)->Arg(512)
+
+static void BM_MakeGuid(benchmark::State& state) {
+	uint8_t buf[16];
+	for (auto _ : state) {
+		parse_uuid(SERVICE_UUID, buf);
+		benchmark::DoNotOptimize(buf);
+	}
+}
+BENCHMARK(BM_MakeGuid);
+
+static void BM_Hsh(benchmark::State& state) {
+	for (auto _ : state)
+		benchmark::DoNotOptimize(hsh(DEVICE_ID));
+}
+BENCHMARK(BM_Hsh);
+
+using BenchCache = map<long, DeviceCacheEntryT<void*, void*, void*>>;
+
+// fills the cache with state.range(0) devices with 4 services each with 8 characteristics
+static void fillCache(BenchCache& cache, int devices) {
+	static int dummy;
+	for (int d = 0; d < devices; d++) {
+		auto deviceId = wstring(DEVICE_ID) + to_wstring(d);
+		auto& device = cache[hsh(deviceId.c_str())];
+		device.device = &dummy;
+		for (int s = 0; s < 4; s++) {
+			auto serviceId = wstring(SERVICE_UUID) + to_wstring(s);
+			auto& service = device.services[hsh(serviceId.c_str())];
+			service.service = &dummy;
+			for (int c = 0; c < 8; c++) {
+				auto characteristicId = wstring(CHARACTERISTIC_UUID) + to_wstring(c);
+				service.characteristics[hsh(characteristicId.c_str())].characteristic = &dummy;
+			}
+		}
+	}
+	// the entry that is looked up
+	cache[hsh(DEVICE_ID)].services[hsh(SERVICE_UUID)].characteristics[hsh(CHARACTERISTIC_UUID)].characteristic = &dummy;
+}
+
+static void BM_CacheLookup(benchmark::State& state) {
+	BenchCache cache;
+	mutex cacheLock;
+	fillCache(cache, (int)state.range(0));
+	for (auto _ : state) {
+		lock_guard lock(cacheLock);
+		benchmark::DoNotOptimize(findCachedCharacteristic(cache, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID));
+	}
+}
+BENCHMARK(BM_CacheLookup)->Arg(1)->Arg(8)->Arg(32);
+
+static vector<uint8_t> payload(size_t size) {
+	vector<uint8_t> buf(size);
+	for (size_t i = 0; i < size; i++)
+		buf[i] = (uint8_t)i;
+	return buf;
+}
+
+// the part of Characteristic_ValueChanged after the strings have been retrieved from winrt
+static void BM_BuildRecord(benchmark::State& state) {
+	const auto buf = payload(state.range(0));
+	BLEData data;
+	for (auto _ : state) {
+		fill_data(data, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID, buf.data(), buf.size());
+		benchmark::DoNotOptimize(data);
+	}
+	state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_BuildRecord) PAYLOAD_SIZES;
+
+// push from a notification followed by a PollData call, i.e. the consumer keeps up
+static void BM_PollDataRoundTrip(benchmark::State& state) {
+	SignalQueue<BLEData> dataQueue;
+	atomic<bool> quitFlag = false;
+	const auto buf = payload(state.range(0));
+	BLEData in, out;
+	fill_data(in, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID, buf.data(), buf.size());
+	for (auto _ : state) {
+		dataQueue.push(in);
+		dataQueue.pop(&out, false, quitFlag);
+		benchmark::DoNotOptimize(out);
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PollDataRoundTrip) PAYLOAD_SIZES;
+
+// a burst of notifications that is drained by successive PollData calls afterwards
+static void BM_PollDataBurst(benchmark::State& state) {
+	SignalQueue<BLEData> dataQueue;
+	atomic<bool> quitFlag = false;
+	const int burst = 64;
+	const auto buf = payload(state.range(0));
+	BLEData in, out;
+	fill_data(in, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID, buf.data(), buf.size());
+	for (auto _ : state) {
+		for (int i = 0; i < burst; i++)
+			dataQueue.push(in);
+		while (dataQueue.pop(&out, false, quitFlag))
+			benchmark::DoNotOptimize(out);
+	}
+	state.SetItemsProcessed(state.iterations() * burst);
+}
+BENCHMARK(BM_PollDataBurst) PAYLOAD_SIZES;
+
+// Every benchmark thread acts as one producer (a notification handler) and polls one record afterwards, so all
+// threads contend on the queue lock while the queue stays short.
+static SignalQueue<BLEData> sharedQueue;
+
+static void BM_DataQueueContention(benchmark::State& state) {
+	static atomic<bool> quitFlag = false;
+	const auto buf = payload(state.range(0));
+	BLEData in, out;
+	fill_data(in, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID, buf.data(), buf.size());
+	for (auto _ : state) {
+		sharedQueue.push(in);
+		sharedQueue.pop(&out, false, quitFlag);
+		benchmark::DoNotOptimize(out);
+	}
+	state.SetItemsProcessed(state.iterations());
+	if (state.thread_index() == 0)
+		sharedQueue.clear();
+}
+BENCHMARK(BM_DataQueueContention) PAYLOAD_SIZES ->ThreadRange(1, 8)->UseRealTime();
+
+// The real case: several devices notify on their own threadpool threads and one thread drains the queue with PollData.
+// The producers keep at most 1024 records queued so that a slow consumer measures contention, not memory growth.
+static void BM_DataQueueProducers(benchmark::State& state) {
+	SignalQueue<BLEData> dataQueue;
+	atomic<bool> quitFlag = false;
+	atomic<bool> stop = false;
+	atomic<int> queued = 0;
+	const auto buf = payload(state.range(0));
+	BLEData in, out;
+	fill_data(in, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID, buf.data(), buf.size());
+	vector<thread> producers;
+	for (int i = 0; i < state.range(1); i++) {
+		producers.emplace_back([&] {
+			while (!stop) {
+				if (queued.load(memory_order_relaxed) >= 1024) {
+					this_thread::yield();
+					continue;
+				}
+				queued++;
+				dataQueue.push(in);
+			}
+		});
+	}
+	for (auto _ : state) {
+		while (!dataQueue.pop(&out, true, quitFlag));
+		queued--;
+		benchmark::DoNotOptimize(out);
+	}
+	stop = true;
+	for (auto& producer : producers)
+		producer.join();
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DataQueueProducers)->ArgsProduct({ { 20, 64, 128, 244, 512 }, { 1, 2, 4, 8 } })->ArgNames({ "size", "producers" })->UseRealTime();
+
+// the per notification cost of the stream analyzer with a 2 byte sequence number and an occasional gap
+static void BM_StreamAnalyzer(benchmark::State& state) {
+	StreamAnalyzer analyzer;
+	analyzer.configure(0, 2, 0, 10000);
+	auto buf = payload(state.range(0));
+	uint16_t seq = 0;
+	int64_t timeUs = 0;
+	for (auto _ : state) {
+		seq += (seq % 100 == 0) ? 2 : 1;
+		buf[0] = (uint8_t)seq;
+		buf[1] = (uint8_t)(seq >> 8);
+		timeUs += 10000;
+		analyzer.update(buf.data(), buf.size(), timeUs);
+	}
+	benchmark::DoNotOptimize(analyzer.stats());
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_StreamAnalyzer)->Arg(20)->Arg(244);
+
+// one notification written to the broadcast ring and read by every registered consumer
+static void BM_BroadcastPushPoll(benchmark::State& state) {
+	static BroadcastRing<BLEData> broadcast;
+	atomic<bool> quitFlag = false;
+	broadcast.reset(256);
+	vector<int> consumers;
+	for (int i = 0; i < state.range(1); i++)
+		consumers.push_back(broadcast.addConsumer());
+	const auto buf = payload(state.range(0));
+	BLEData in, out;
+	fill_data(in, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID, buf.data(), buf.size());
+	for (auto _ : state) {
+		broadcast.push(in);
+		for (int consumer : consumers)
+			broadcast.pop(consumer, &out, false, quitFlag);
+		benchmark::DoNotOptimize(out);
+	}
+	state.SetItemsProcessed(state.iterations());
+	broadcast.removeConsumers();
+}
+BENCHMARK(BM_BroadcastPushPoll)->ArgsProduct({ { 20, 244, 512 }, { 1, 3 } });
+
+// producer cost while one consumer polls continuously on another thread and never blocks it
+static void BM_BroadcastProducer(benchmark::State& state) {
+	static BroadcastRing<BLEData> broadcast;
+	atomic<bool> quitFlag = false;
+	broadcast.reset(256);
+	const int consumer = broadcast.addConsumer();
+	thread reader([&] {
+		BLEData out;
+		while (broadcast.pop(consumer, &out, true, quitFlag))
+			benchmark::DoNotOptimize(out);
+	});
+	const auto buf = payload(state.range(0));
+	BLEData in;
+	fill_data(in, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID, buf.data(), buf.size());
+	for (auto _ : state)
+		broadcast.push(in);
+	quitFlag = true;
+	broadcast.wake();
+	reader.join();
+	uint64_t lag, overruns;
+	broadcast.stats(consumer, &lag, &overruns);
+	broadcast.removeConsumer(consumer);
+	state.counters["overruns"] = (double)overruns;
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BroadcastProducer) PAYLOAD_SIZES;
+
+// draining 64 finished operations from the completion queue, one PollCompletions call per batch of state.range(0)
+static void BM_CompletionDrain(benchmark::State& state) {
+	SignalQueue<Completion> completionQueue;
+	atomic<bool> quitFlag = false;
+	const int inFlight = 64;
+	const size_t batch = state.range(0);
+	vector<Completion> out(batch);
+	Completion in{};
+	in.type = OperationType::WRITE;
+	in.success = true;
+	for (auto _ : state) {
+		for (int i = 0; i < inFlight; i++) {
+			in.id = i + 1;
+			completionQueue.push(in);
+		}
+		while (completionQueue.popBatch(out.data(), batch, false, quitFlag) > 0)
+			benchmark::DoNotOptimize(out.data());
+	}
+	state.SetItemsProcessed(state.iterations() * inFlight);
+}
+BENCHMARK(BM_CompletionDrain)->Arg(1)->Arg(16)->Arg(64);
+
+// Latency from a notification event until the record can be polled, measured on the polling thread. Without the
+// dispatcher the event thread builds and queues the record itself, with the dispatcher it only posts the raw payload.
+struct RawNotification {
+	chrono::steady_clock::time_point received;
+	uint8_t buf[512];
+	size_t size;
+};
+
+static void reportLatencies(benchmark::State& state, vector<double>& latencies) {
+	if (latencies.empty())
+		return;
+	sort(latencies.begin(), latencies.end());
+	state.counters["p50_us"] = latencies[latencies.size() / 2] * 1e6;
+	state.counters["p99_us"] = latencies[latencies.size() * 99 / 100] * 1e6;
+	state.counters["max_us"] = latencies.back() * 1e6;
+}
+
+static void BM_NotificationLatency(benchmark::State& state) {
+	const bool dispatched = state.range(1) != 0;
+	SignalQueue<BLEData> dataQueue;
+	atomic<bool> quitFlag = false;
+	const auto buf = payload(state.range(0));
+	auto buildAndDeliver = [&](const RawNotification& notification) {
+		BLEData data;
+		fill_data(data, DEVICE_ID, SERVICE_UUID, CHARACTERISTIC_UUID, notification.buf, notification.size);
+		memcpy(data.buf, &notification.received, sizeof(notification.received));
+		dataQueue.push(data);
+	};
+	DispatchThread<RawNotification> dispatcher;
+	if (dispatched)
+		dispatcher.start([] {}, buildAndDeliver);
+
+	// the event thread, standing in for the WinRT threadpool
+	atomic<bool> stop = false;
+	atomic<int> requested = 0;
+	thread events([&] {
+		RawNotification notification;
+		notification.size = buf.size();
+		memcpy(notification.buf, buf.data(), buf.size());
+		int sent = 0;
+		while (!stop) {
+			if (requested.load() == sent) {
+				this_thread::yield();
+				continue;
+			}
+			sent++;
+			notification.received = chrono::steady_clock::now();
+			if (dispatched)
+				dispatcher.post(notification);
+			else
+				buildAndDeliver(notification);
+		}
+	});
+
+	vector<double> latencies;
+	BLEData out;
+	for (auto _ : state) {
+		requested++;
+		while (!dataQueue.pop(&out, true, quitFlag));
+		const auto now = chrono::steady_clock::now();
+		chrono::steady_clock::time_point received;
+		memcpy(&received, out.buf, sizeof(received));
+		const double latency = chrono::duration<double>(now - received).count();
+		state.SetIterationTime(latency);
+		latencies.push_back(latency);
+	}
+	stop = true;
+	events.join();
+	dispatcher.stop();
+	reportLatencies(state, latencies);
+}
+BENCHMARK(BM_NotificationLatency)->ArgsProduct({ { 20, 244 }, { 0, 1 } })->ArgNames({ "size", "dispatcher" })->UseManualTime();
+
+BENCHMARK_MAIN();
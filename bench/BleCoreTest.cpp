@@ -0,0 +1,236 @@
+// BleCoreTest.cpp : Correctness checks for the platform independent parts of the dll (see BleWinrtDll/BleCore.h).
+//
+// Built with the benchmarks and run by ctest:
+//   cmake -S bench -B bench/build && cmake --build bench/build && ctest --test-dir bench/build
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "BleCore.h"
+
+using namespace std;
+
+static atomic<int> failures = 0;
+
+#define CHECK_EQ(actual, expected) \
+	do { \
+		const auto a = (actual); \
+		const auto e = (expected); \
+		if (a != e) { \
+			printf("%s:%d: %s is %llu, expected %llu\n", __FILE__, __LINE__, #actual, (unsigned long long)a, (unsigned long long)e); \
+			failures++; \
+		} \
+	} while (false)
+
+// feeds the sequence numbers as little endian field of the given width at offset 1, 10 ms apart
+static void feed(StreamAnalyzer& analyzer, const vector<uint64_t>& seqs, uint32_t width) {
+	static int64_t timeUs = 0;
+	uint8_t buf[8] = { };
+	for (auto seq : seqs) {
+		for (uint32_t i = 0; i < width; i++)
+			buf[1 + i] = (uint8_t)(seq >> (8 * i));
+		timeUs += 10000;
+		analyzer.update(buf, 1 + width, timeUs);
+	}
+}
+
+static vector<uint64_t> range(uint64_t from, uint64_t count) {
+	vector<uint64_t> seqs;
+	for (uint64_t i = 0; i < count; i++)
+		seqs.push_back(from + i);
+	return seqs;
+}
+
+static void testInOrder() {
+	StreamAnalyzer analyzer;
+	analyzer.configure(1, 2, 0, 10000);
+	feed(analyzer, range(0, 70000), 2);
+	const auto stats = analyzer.stats();
+	CHECK_EQ(stats.received, 70000u);
+	CHECK_EQ(stats.lost, 0u);
+	CHECK_EQ(stats.gaps, 0u);
+	CHECK_EQ(stats.reordered, 0u);
+	CHECK_EQ(stats.discontinuities, 0u);
+	CHECK_EQ(stats.meanIntervalUs, 10000u);
+	CHECK_EQ(stats.intervalHistogram[2], 69999u);
+}
+
+static void testGapDuplicateReorder() {
+	StreamAnalyzer analyzer;
+	analyzer.configure(1, 1, 0, 0);
+	// 3 and 4 missing, 5 twice, 4 arrives late
+	feed(analyzer, { 1, 2, 5, 5, 4, 6 }, 1);
+	const auto stats = analyzer.stats();
+	CHECK_EQ(stats.gaps, 1u);
+	CHECK_EQ(stats.lost, 1u);
+	CHECK_EQ(stats.duplicates, 1u);
+	CHECK_EQ(stats.reordered, 1u);
+	CHECK_EQ(stats.discontinuities, 0u);
+}
+
+static void testWrap() {
+	StreamAnalyzer analyzer;
+	analyzer.configure(1, 1, 100, 0);
+	feed(analyzer, { 97, 98, 99, 0, 1, 3 }, 1);
+	const auto stats = analyzer.stats();
+	CHECK_EQ(stats.gaps, 1u);
+	CHECK_EQ(stats.lost, 1u);
+	CHECK_EQ(stats.reordered, 0u);
+}
+
+// a device that restarts its counter must not turn every later frame into a reordered one
+static void testRestart() {
+	for (uint32_t width : { 2u, 4u }) {
+		StreamAnalyzer analyzer;
+		analyzer.configure(1, width, 0, 0);
+		feed(analyzer, range(0, 30000), width);
+		feed(analyzer, range(0, 3000), width);
+		const auto stats = analyzer.stats();
+		CHECK_EQ(stats.discontinuities, 1u);
+		CHECK_EQ(stats.reordered, 0u);
+		CHECK_EQ(stats.lost, 0u);
+		CHECK_EQ(stats.gaps, 0u);
+	}
+}
+
+static void testOutOfPayload() {
+	StreamAnalyzer analyzer;
+	analyzer.configure(0xFFFFFFFF, 2, 0, 0);
+	uint8_t buf[4] = { };
+	analyzer.update(buf, sizeof(buf), 0);
+	analyzer.update(buf, sizeof(buf), 10000);
+	const auto stats = analyzer.stats();
+	CHECK_EQ(stats.received, 2u);
+	CHECK_EQ(stats.malformed, 2u);
+}
+
+// configurations the analyzer can't count with are rejected and leave the previous one in place
+static void testInvalidConfig() {
+	StreamAnalyzer analyzer;
+	CHECK_EQ(analyzer.configure(1, 4, 0xFFFFFFFF, 0), true);
+	CHECK_EQ(analyzer.configure(1, 1, 256, 0), true);
+	CHECK_EQ(analyzer.configure(1, 5, 0, 0), false);
+	CHECK_EQ(analyzer.configure(1, 1, 257, 0), false);
+	CHECK_EQ(analyzer.configure(1, 2, 1, 0), false);
+	feed(analyzer, { 254, 255, 0, 1 }, 1);
+	const auto stats = analyzer.stats();
+	CHECK_EQ(stats.duplicates, 0u);
+	CHECK_EQ(stats.discontinuities, 0u);
+	CHECK_EQ(stats.gaps, 0u);
+}
+
+// every blocked poller must return after quit, also if quit is set right before they wait
+static void testQueueQuit() {
+	for (int round = 0; round < 100; round++) {
+		SignalQueue<int> queue;
+		atomic<bool> quit = false;
+		atomic<int> released = 0;
+		vector<thread> pollers;
+		for (int i = 0; i < 4; i++) {
+			pollers.emplace_back([&, i] {
+				int items[4];
+				if (i % 2 == 0)
+					CHECK_EQ(queue.pop(items, true, quit), false);
+				else
+					CHECK_EQ(queue.popBatch(items, 4, true, quit), 0u);
+				released++;
+			});
+		}
+		if (round % 2 == 0)
+			this_thread::sleep_for(chrono::milliseconds(1));
+		quit = true;
+		queue.wake();
+		for (auto& poller : pollers)
+			poller.join();
+		CHECK_EQ(released.load(), 4);
+	}
+}
+
+// a blocking batch poll only returns with items
+static void testQueueBatch() {
+	SignalQueue<int> queue;
+	atomic<bool> quit = false;
+	thread producer([&] {
+		this_thread::sleep_for(chrono::milliseconds(5));
+		for (int i = 0; i < 10; i++)
+			queue.push(i);
+	});
+	int items[16];
+	size_t total = 0;
+	while (total < 10) {
+		const size_t n = queue.popBatch(items + total, 16 - total, true, quit);
+		CHECK_EQ(n > 0, true);
+		total += n;
+	}
+	producer.join();
+	for (int i = 0; i < 10; i++)
+		CHECK_EQ(items[i], i);
+}
+
+// the ring must not be replaced under registered consumers, and a removed consumer must not block
+static void testBroadcastReset() {
+	BroadcastRing<int> broadcast;
+	atomic<bool> quit = false;
+	CHECK_EQ(broadcast.reset(4), true);
+	const int consumer = broadcast.addConsumer();
+	CHECK_EQ(broadcast.reset(8), false);
+	for (int i = 0; i < 6; i++)
+		broadcast.push(i);
+	int item = -1;
+	CHECK_EQ(broadcast.pop(consumer, &item, false, quit), true);
+	CHECK_EQ(item, 2);
+	uint64_t lag, overruns;
+	broadcast.stats(consumer, &lag, &overruns);
+	CHECK_EQ(lag, 3u);
+	CHECK_EQ(overruns, 2u);
+
+	thread poller([&] {
+		int item;
+		while (broadcast.pop(consumer, &item, true, quit));
+	});
+	this_thread::sleep_for(chrono::milliseconds(5));
+	broadcast.removeConsumer(consumer);
+	poller.join();
+	CHECK_EQ(broadcast.reset(0), true);
+	CHECK_EQ(broadcast.enabled(), false);
+	CHECK_EQ(broadcast.pop(consumer, &item, true, quit), false);
+	CHECK_EQ(broadcast.reset(16), true);
+	const int next = broadcast.addConsumer();
+	broadcast.push(42);
+	CHECK_EQ(broadcast.pop(next, &item, false, quit), true);
+	CHECK_EQ(item, 42);
+}
+
+// an item posted after stop is refused instead of being handled by the next start
+static void testDispatchRestart() {
+	DispatchThread<int> dispatcher;
+	CHECK_EQ(dispatcher.post(1), false);
+	atomic<int> handled = 0;
+	dispatcher.start([] {}, [&](int item) { handled += item; });
+	dispatcher.stop();
+	CHECK_EQ(dispatcher.post(10), false);
+	dispatcher.start([] {}, [&](int item) { handled += item; });
+	CHECK_EQ(dispatcher.post(100), true);
+	for (int i = 0; i < 1000 && handled == 0; i++)
+		this_thread::sleep_for(chrono::milliseconds(1));
+	dispatcher.stop();
+	CHECK_EQ(handled.load(), 100);
+}
+
+int main() {
+	testInOrder();
+	testGapDuplicateReorder();
+	testWrap();
+	testRestart();
+	testOutOfPayload();
+	testInvalidConfig();
+	testQueueQuit();
+	testQueueBatch();
+	testBroadcastReset();
+	testDispatchRestart();
+	if (failures == 0)
+		printf("all checks passed\n");
+	return failures == 0 ? 0 : 1;
+}